@@ -2,6 +2,8 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= videoplayer.c
+LOCAL_ARM_NEON := true
+LOCAL_CFLAGS += -DUSE_SDL2
 LOCAL_LDLIBS := -lz -lm
 LOCAL_MODULE := videoplayer
 LOCAL_SHARED_LIBRARIES := libswresample libavformat libavcodec libswscale libavutil SDL2
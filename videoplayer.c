@@ -14,57 +14,299 @@
 #include <libswscale/swscale.h>
 #include <libavutil/avstring.h>
 #include <libavutil/time.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 
+#ifdef USE_SDL2
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_thread.h>
+#else
 #include <SDL/SDL.h>
 #include <SDL/SDL_thread.h>
+#endif
 
 #ifdef __MINGW32__
 #undef main /* Prevents SDL from overriding main() */
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
-#define MAX_AUDIO_FRAME_SIZE 192000
 
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+/* The demuxer stops reading once every stream has MIN_FRAMES packets
+   covering at least QUEUE_MIN_DURATION seconds, or once all queues
+   together hold MAX_QUEUE_SIZE bytes. A low bitrate stream is thus
+   buffered by time and a very high bitrate one by memory. */
+#define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+#define MIN_FRAMES 25
+#define QUEUE_MIN_DURATION 1.0
+
+#define PACKET_QUEUE_CAPACITY 1024 /* must be a power of two */
+
+#define MAPPED_IO_BUFFER_SIZE 32768
+#define MAPPED_WILLNEED_WINDOW (8 << 20) /* bytes asked to be paged in ahead of the demuxer */
+#define READAHEAD_CHUNK_SIZE (256 * 1024)  /* largest single read of the read-ahead thread */
 
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
 
+/* consecutive late pictures before the decoder starts skipping
+   non-reference frames */
+#define LATE_STREAK_SKIP_NONREF 4
+
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
 
 #define FF_ALLOC_EVENT (SDL_USEREVENT)
-#define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
+#define FF_FIRST_FRAME_EVENT (SDL_USEREVENT + 3)
+#define FF_DISPLAY_EVENT (SDL_USEREVENT + 4)
+
+#ifdef USE_SDL2
+/* SDL2 names its threads and calls key codes something else */
+#define create_thread(fn, arg) SDL_CreateThread(fn, #fn, arg)
+typedef SDL_Keycode SDLKey;
+#else
+#define create_thread(fn, arg) SDL_CreateThread(fn, arg)
+#endif
+
+/* default and maximum number of decoded pictures the video thread may
+   run ahead of the display; the depth is chosen with -pictq */
+#define VIDEO_PICTURE_QUEUE_SIZE 3
+#define VIDEO_PICTURE_QUEUE_SIZE_MAX 16
 
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+/* most inputs -mosaic shows at once */
+#define MOSAIC_MAX 16
 
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_VIDEO_MASTER
 
+/* The demuxer feeds several queues, so when they are full it sleeps on
+   this instead of on any one queue's cond. Consumers signal it after
+   taking a packet, but only while sleeping is set. */
+typedef struct DemuxWaiter
+{
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    atomic_int sleeping;
+} DemuxWaiter;
+
+/* Each PacketQueue has exactly one producer (decode_thread) and one
+   consumer (video_thread or audio_thread), so it is a bounded
+   single-producer/single-consumer ring. head is only written by the
+   consumer and tail only by the producer; the mutex/cond pair is only
+   touched when one side has to sleep on an empty or full ring. */
 typedef struct PacketQueue
 {
-    AVPacketList *first_pkt, *last_pkt;
-    int nb_packets;
-    int size;
+    AVPacket *pkts;       /* PACKET_QUEUE_CAPACITY slots */
+    atomic_uint head;     /* next slot to read */
+    atomic_uint tail;     /* next slot to write */
+    atomic_int size;      /* bytes of payload queued */
+    atomic_llong duration; /* sum of the queued pkt->duration, in time_base */
+    AVRational time_base;
+    atomic_int sleepers;  /* threads parked on cond */
+    atomic_int flushes;   /* flush packets queued and not taken yet */
+    atomic_int abort_request; /* set by packet_queue_abort, fails every call after */
+    int64_t bytes_copied; /* payload bytes copied by packet_queue_put */
     SDL_mutex *mutex;
     SDL_cond *cond;
+    DemuxWaiter *space; /* signalled when a packet is taken, may be NULL */
 } PacketQueue;
 
+/* Decoded PCM on its way to the sound card. audio_thread is the only
+   writer and audio_callback the only reader, so like PacketQueue it is
+   a lock-free ring; head and tail count bytes and are never wrapped,
+   only their offsets into buf are. The size is a whole number of
+   samples so a sample never straddles the end of buf, which lets
+   swr_convert write straight into it. The callback must never block, so
+   the writer is the one that waits: it sleeps on space, which the
+   callback posts after a read when the writer said it was waiting. */
+typedef struct AudioRing
+{
+    uint8_t *buf;
+    unsigned int size;  /* frame_bytes times a power of two */
+    atomic_ullong head; /* bytes written */
+    atomic_ullong tail; /* bytes read */
+    atomic_int eof;    /* the writer has finished */
+    atomic_int waiting; /* the writer is (about to be) asleep on space */
+    SDL_sem *space;
+} AudioRing;
+
+enum
+{
+    FRAME_DROP_DISPLAY, /* behind the clock when its turn to be shown came */
+    FRAME_DROP_DECODE,  /* behind the clock as soon as it was decoded */
+    FRAME_DROP_NONREF,  /* never decoded, skip_frame = AVDISCARD_NONREF */
+    FRAME_DROP_NB
+};
+
+#define AUDIO_KERNEL_CHANNELS_MAX 8
+
+/* how audio_write_frame gets decoded samples into the ring */
+enum
+{
+    AUDIO_CONVERT_COPY, /* already interleaved s16 at the device's rate and layout */
+    AUDIO_CONVERT_FLTP, /* sample_kernels.fltp_to_s16 */
+    AUDIO_CONVERT_S16P, /* sample_kernels.s16p_to_s16 */
+    AUDIO_CONVERT_SWR,  /* anything else: swresample */
+};
+
+/* pipeline stages timed into VideoState.stage_hist */
+enum
+{
+    STAGE_DEMUX,          /* av_read_frame */
+    STAGE_VIDEO_DECODE,   /* avcodec_decode_video2 */
+    STAGE_AUDIO_DECODE,   /* avcodec_decode_audio4 */
+    STAGE_SCALE,          /* sws_scale */
+    STAGE_REPACK,         /* repack_picture, in place of sws_scale */
+    STAGE_RESAMPLE,       /* swr_convert */
+    STAGE_UPLOAD,         /* copying a referenced frame into its texture (SDL2) */
+    STAGE_DISPLAY,        /* SDL_DisplayYUVOverlay, or SDL2 drawing and presenting */
+    STAGE_AUDIO_CALLBACK, /* one audio_callback invocation */
+    STAGE_NB
+};
+
+static const char *stage_names[STAGE_NB] = {
+    "demux", "video_decode", "audio_decode", "sws_scale", "repack",
+    "resample", "overlay_upload", "display", "audio_callback"};
+
+/* queue depths sampled into VideoState.gauges */
+enum
+{
+    GAUGE_AUDIOQ_PACKETS,
+    GAUGE_AUDIOQ_BYTES,
+    GAUGE_VIDEOQ_PACKETS,
+    GAUGE_VIDEOQ_BYTES,
+    GAUGE_PICTQ_PICTURES,
+    GAUGE_AUDIO_RING_BYTES,
+    GAUGE_NB
+};
+
+static const char *gauge_names[GAUGE_NB] = {
+    "audioq_packets", "audioq_bytes", "videoq_packets", "videoq_bytes",
+    "pictq_pictures", "audio_ring_bytes"};
+
+/* Latency histogram in microseconds. Values below 4 get a bucket each,
+   above that every power of two is split into 4 buckets, so a bucket is
+   never more than 25% wide. Any thread may add to it without locking. */
+#define HISTOGRAM_BUCKETS 128
+
+typedef struct Histogram
+{
+    atomic_llong buckets[HISTOGRAM_BUCKETS];
+    atomic_llong count;
+    atomic_llong sum;
+    atomic_llong max;
+} Histogram;
+
+typedef struct Gauge
+{
+    atomic_int last;
+    atomic_int max;
+    atomic_llong sum;
+    atomic_llong samples;
+} Gauge;
+
+#define SCALE_THREADS_MAX 16
+
+struct ScalePool;
+
+typedef struct ScaleWorker
+{
+    struct ScalePool *pool;
+    SDL_Thread *tid; /* NULL for band 0, which the caller converts */
+    SDL_sem *start;
+    struct SwsContext *sws;
+    int src_y, src_h; /* source rows of this band */
+    int dst_y, dst_h; /* destination rows of this band */
+} ScaleWorker;
+
+typedef struct ScalePool
+{
+    int nb_workers;
+    ScaleWorker workers[SCALE_THREADS_MAX];
+    SDL_sem *done;
+    int quit;
+    int src_log2_chroma_h;
+
+    /* geometry the contexts were made for */
+    int src_w, src_h, dst_w, dst_h;
+    enum AVPixelFormat src_fmt;
+
+    /* the picture being converted */
+    uint8_t *src[4];
+    int src_linesize[4];
+    uint8_t *dst[3];
+    int dst_linesize[3];
+} ScalePool;
+
 typedef struct VideoPicture
 {
+#ifdef USE_SDL2
+    SDL_Texture *bmp; /* streaming IYUV texture, only used by the main thread */
+    AVPicture pict;   /* what queue_picture converted, uploaded when shown */
+    AVFrame *frame;   /* decoded picture held by reference until it is shown */
+#else
     SDL_Overlay *bmp;
+#endif
     int width, height; /* source height & width */
     int allocated;
     double pts;
+    int serial; /* seek_serial it was decoded for */
 } VideoPicture;
 
+/* a local file mmap()ed whole, read through a custom AVIOContext */
+typedef struct MappedInput
+{
+    uint8_t *data;
+    int64_t size;
+    int64_t pos;
+    int64_t advised_from, advised_to; /* range last given MADV_WILLNEED */
+} MappedInput;
+
+struct VideoState;
+
+/* window of input bytes read ahead of the demuxer, see readahead_thread */
+typedef struct ReadAhead
+{
+    struct VideoState *is;
+    AVIOContext *src;
+    int64_t src_size;
+    SDL_Thread *tid;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+
+    uint8_t *buf;
+    int size;    /* the -readahead window */
+    int rpos;    /* offset in buf of the next byte for the demuxer */
+    int fill;    /* bytes read ahead */
+    int64_t pos; /* input position of the byte at rpos */
+    int eof;
+    int serial; /* bumped by every seek, so reads in flight are dropped */
+    int seek_request;
+    int64_t seek_pos, seek_result;
+
+    /* stats */
+    int64_t reads, stalled_reads;
+    int seeks_in_window, seeks_refill;
+    Histogram stall; /* us the demuxer waited on a read or seek */
+} ReadAhead;
+
 typedef struct VideoState
 {
 
@@ -79,19 +321,24 @@ typedef struct VideoState
     AVStream *audio_st;
     PacketQueue audioq;
     AVFrame audio_frame;
-    uint8_t audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
-    unsigned int audio_buf_size;
-    unsigned int audio_buf_index;
+    int audio_out_rate;      /* what audio_thread writes to the ring: */
+    int audio_out_channels;  /* s16 at the rate and channel count the */
+    int audio_frame_bytes;   /* device opened with, bytes per sample */
+    int audio_convert;       /* AUDIO_CONVERT_* */
     AVPacket audio_pkt;
     uint8_t *audio_pkt_data;
     int audio_pkt_size;
     int audio_hw_buf_size;
+    AudioRing audio_ring;
+    double audio_ring_clock; /* pts of the sample at the ring's write position */
+    int audio_underruns;     /* callbacks that found the ring short */
+    atomic_llong audio_bytes_touched; /* PCM bytes written or read after decoding */
+    int audio_compensations;          /* swr_set_compensation calls */
     double audio_diff_cum; /* used for AV difference average computation */
     double audio_diff_avg_coef;
     double audio_diff_threshold;
     int audio_diff_avg_count;
-    uint8_t audio_need_resample;
-    double frame_timer;
+    double frame_timer; /* seconds on monotonic_time()'s clock */
     double frame_last_pts;
     double frame_last_delay;
     double video_clock;             ///<pts of last decoded frame / predicted pts of next decoded frame
@@ -99,27 +346,89 @@ typedef struct VideoState
     int64_t video_current_pts_time; ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts
     AVStream *video_st;
     PacketQueue videoq;
+    DemuxWaiter demux_space; /* decode_thread waits here for room in the queues */
 
-    VideoPicture pictq[VIDEO_PICTURE_QUEUE_SIZE];
+    VideoPicture pictq[VIDEO_PICTURE_QUEUE_SIZE_MAX];
+    int pictq_max; /* depth in use, at most VIDEO_PICTURE_QUEUE_SIZE_MAX */
     int pictq_size, pictq_rindex, pictq_windex;
     SDL_mutex *pictq_mutex;
     SDL_cond *pictq_cond;
 
+    int frame_drops[FRAME_DROP_NB]; /* pictures dropped, by reason */
+    int late_streak;                /* consecutive pictures the display found late */
+
+    Histogram stage_hist[STAGE_NB];
+    Histogram present_wakeup_error; /* how late the presentation thread woke, us */
+    Histogram av_offset;            /* |picture pts - audio clock| when shown, us */
+    double av_offset_last;          /* signed, seconds; > 0 is video ahead */
+    double av_offset_sum;
+    int av_offset_count;
+    Gauge gauges[GAUGE_NB];
+    int video_frames;
+    int64_t audio_samples;
+    AVPicture headless_pict; /* sws_scale target when there is no overlay */
+    int headless_w, headless_h; /* its size, that of the last frame */
+
     SDL_Thread *parse_tid;
     SDL_Thread *video_tid;
+    SDL_Thread *present_tid;
+    SDL_Thread *audio_tid;
+    SDL_Thread *stats_tid;
+    SDL_sem *stats_wake; /* posted by stream_abort to end stats_thread's wait */
 
     char filename[1024];
+    char stats_file[1024]; /* -stats F, or F.<tile> for a -mosaic tile */
+    int tile;              /* -mosaic cell it is drawn in, -1 for the whole window */
+    int generation;        /* tags its events, see event_from */
+    int audio_disable;     /* a -mosaic tile not heard: the audio stream is not opened */
     int quit;
 
-    AVIOContext *io_context;
-    struct SwsContext *sws_ctx;
+    /* end of stream: the demuxer queues an empty packet on each stream,
+       the decoders drain on it and each stream is finished once its last
+       picture or sample has been presented. The flags hold the
+       seek_serial they happened in, -1 for never. */
+    int audio_draining;
+    atomic_int audio_ready; /* audio_ring can be read by the callback */
+    atomic_int video_eos; /* video_thread has queued its last picture */
+    atomic_int audio_eos; /* audio_thread has written its last sample */
+    atomic_int video_finished, audio_finished;
+    atomic_int audio_played_out; /* audio_eos the callback has played to the end */
+    int first_frame_sent;        /* audio_thread has told main about the first sample */
+
+    /* seeking, see stream_seek */
+    atomic_int seek_req;
+    int64_t seek_pos;        /* AV_TIME_BASE units */
+    int64_t seek_start;      /* av_gettime_relative() of the request */
+    double seek_target;      /* seconds; what comes before is decoded, not shown */
+    atomic_int seek_serial;  /* bumped by every seek */
+    atomic_int video_serial; /* seek_serial video_thread is decoding for */
+    int audio_serial;        /* and audio_thread */
+    int frame_serial;        /* and the picture shown last */
+    double video_skip_until, audio_skip_until;
+    int seeks;
+    int seek_frames_skipped;
+    Histogram seek_latency; /* request to first picture shown, us */
+
+    AVIOContext *io_context; /* our own AVIOContext, if the demuxer reads through one */
+    MappedInput *mapped;
+    ReadAhead *readahead;
+
+    /* startup, us: avformat_open_input, finding the stream parameters,
+       and av_gettime_relative() at main's start and at the first frame */
+    int64_t open_time, probe_time;
+    int64_t launch_time;
+    atomic_llong first_frame_time;
+    int probe_cache_hit;
+    ScalePool scale_pool;
+    int overlay_w, overlay_h; /* size queue_picture wants overlays made at */
+#ifdef USE_SDL2
+    SDL_Texture *shown;  /* the texture on screen, redrawn with every other tile */
+    int display_pending; /* the main thread has yet to show pictq_rindex */
+    int display_uploaded; /* in shown, waiting for screen_present; main thread only */
+#endif
 
     SwrContext *pSwrCtx;
 
-    uint8_t *pResampledOut;
-    int resample_lines;
-    uint64_t resample_size;
-
 } VideoState;
 
 enum
@@ -129,1146 +438,5229 @@ enum
     AV_SYNC_EXTERNAL_MASTER,
 };
 
+#ifdef USE_SDL2
+/* With SDL2 only the main thread draws: the presentation threads hand
+   it their pictures with FF_DISPLAY_EVENT. */
+SDL_Window *window;
+SDL_Renderer *renderer;
+static int screen_w, screen_h; /* renderer output size */
+#else
 SDL_Surface *screen;
-
-/* Since we only have one decoding thread, the Big Struct
-   can be global in case we need it. */
-VideoState *global_video_state;
-
-void packet_queue_init(PacketQueue *q)
+#endif
+/* SDL 1.2 video calls are not thread safe: the presentation thread
+   displays while the main thread pumps events and allocates overlays */
+SDL_mutex *screen_mutex;
+
+/* marks a flush packet, see packet_queue_put_flush */
+static AVPacket flush_pkt;
+
+/* The sound card is opened once, by the first item with audio, and
+   shared by the playlist: audio_callback plays from audio_source and,
+   the moment that item is over, carries on with audio_next in the same
+   buffer, so there is no gap between items. */
+static SDL_mutex *audio_device_mutex;
+static int audio_device_open;
+static SDL_AudioSpec audio_device_spec;
+static _Atomic(VideoState *) audio_source;
+static _Atomic(VideoState *) audio_next;
+
+/* -mosaic: every input at once, each in a cell of a cols x rows grid */
+static VideoState *mosaic[MOSAIC_MAX];
+static int nb_mosaic = 0;
+static int mosaic_cols = 1, mosaic_rows = 1;
+static uint8_t *audio_mix_buf; /* one device buffer, for -audio mix */
+
+/* command line options */
+static int pictq_depth = VIDEO_PICTURE_QUEUE_SIZE;
+static int decoder_threads = 0; /* 0 = one per core */
+static int scale_threads = 0;   /* sws_scale bands, 0 = by picture height */
+static int headless = 0;        /* decode flat out, no display or audio device */
+static int use_mmap = 0;        /* map local files instead of read()ing them */
+static int readahead_size = 0;  /* bytes read ahead of the demuxer, 0 = off */
+static int slow_io_ms = 0;      /* delay added to every input read, for testing */
+static int fast_start = 0;       /* probe as little of the input as possible */
+static const char *probe_cache_dir = NULL; /* where probe_streams keeps what it found */
+static const char *stats_path = NULL; /* JSON stats file */
+static int stats_interval = 0;        /* ms between rewrites of stats_path, 0 = at exit only */
+static char **playlist = NULL;        /* the files to play, in order */
+static int nb_playlist = 0;
+static int mosaic_enabled = 0;        /* play the files at once instead of in turn */
+static int audio_tile = 0;            /* -mosaic tile heard, -1 = mix them all */
+static int use_vsync = 0;             /* SDL2: present in step with the display refresh */
+
+/* cores for one instance's decoder and scaler threads: -mosaic shares
+   them out rather than giving every tile all of them */
+static int instance_cores(void)
 {
-    memset(q, 0, sizeof(PacketQueue));
-    q->mutex = SDL_CreateMutex();
-    q->cond = SDL_CreateCond();
+    return FFMAX(1, av_cpu_count() / FFMAX(nb_mosaic, 1));
 }
 
-int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+static int histogram_bucket(int64_t v)
 {
+    int msb, idx;
 
-    AVPacketList *pkt1;
-
-    if (av_dup_packet(pkt) < 0)
+    if (v < 4)
     {
-        return -1;
+        return v < 0 ? 0 : (int)v;
     }
 
-    pkt1 = av_malloc(sizeof(AVPacketList));
+    msb = 63 - __builtin_clzll(v);
+    idx = 4 + (msb - 2) * 4 + (int)((v >> (msb - 2)) & 3);
+
+    return idx < HISTOGRAM_BUCKETS ? idx : HISTOGRAM_BUCKETS - 1;
+}
+
+/* upper bound of a bucket, what the percentiles report */
+static int64_t histogram_bucket_limit(int idx)
+{
+    int octave;
 
-    if (!pkt1)
+    if (idx < 4)
     {
-        return -1;
+        return idx + 1;
     }
 
-    pkt1->pkt = *pkt;
-    pkt1->next = NULL;
+    octave = (idx - 4) / 4;
+    return (int64_t)(4 + (idx - 4) % 4 + 1) << octave;
+}
 
-    SDL_LockMutex(q->mutex);
+static void histogram_add(Histogram *h, int64_t us)
+{
+    int64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
 
-    if (!q->last_pkt)
+    atomic_fetch_add_explicit(&h->buckets[histogram_bucket(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+
+    while (us > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, us,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
     {
-        q->first_pkt = pkt1;
     }
-    else
+}
+
+static int64_t histogram_percentile(Histogram *h, double p)
+{
+    int64_t count = atomic_load(&h->count), seen = 0;
+    int64_t rank = (int64_t)ceil(count * p);
+    int i;
+
+    if (count == 0)
     {
-        q->last_pkt->next = pkt1;
+        return 0;
     }
 
-    q->last_pkt = pkt1;
-    q->nb_packets++;
-    q->size += pkt1->pkt.size;
-    SDL_CondSignal(q->cond);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
 
-    SDL_UnlockMutex(q->mutex);
-    return 0;
+        if (seen >= rank)
+        {
+            int64_t limit = histogram_bucket_limit(i);
+            int64_t max = atomic_load(&h->max);
+            return limit < max ? limit : max;
+        }
+    }
+
+    return atomic_load(&h->max);
 }
 
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+static void gauge_update(Gauge *g, int v)
 {
-    AVPacketList *pkt1;
-    int ret;
+    int max = atomic_load_explicit(&g->max, memory_order_relaxed);
 
-    SDL_LockMutex(q->mutex);
+    atomic_store_explicit(&g->last, v, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g->sum, v, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g->samples, 1, memory_order_relaxed);
 
-    for (;;)
+    while (v > max &&
+           !atomic_compare_exchange_weak_explicit(&g->max, &max, v,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
     {
+    }
+}
 
-        if (global_video_state->quit)
-        {
-            ret = -1;
-            break;
-        }
+void packet_queue_init(PacketQueue *q)
+{
+    memset(q, 0, sizeof(PacketQueue));
+    q->pkts = av_mallocz(PACKET_QUEUE_CAPACITY * sizeof(AVPacket));
+    q->mutex = SDL_CreateMutex();
+    q->cond = SDL_CreateCond();
+}
 
-        pkt1 = q->first_pkt;
+static int packet_queue_nb_packets(PacketQueue *q)
+{
+    return atomic_load(&q->tail) - atomic_load(&q->head);
+}
 
-        if (pkt1)
-        {
-            q->first_pkt = pkt1->next;
+/* Sleep until the ring has a packet (want_space == 0) or a free slot
+   (want_space == 1). The sleeper count is raised before the index is
+   re-checked, so a concurrent packet_queue_wake() either sees it or we
+   see the new index: no wake-up can be lost. */
+static void packet_queue_wait(PacketQueue *q, int want_space)
+{
+    SDL_LockMutex(q->mutex);
+    atomic_fetch_add(&q->sleepers, 1);
 
-            if (!q->first_pkt)
-            {
-                q->last_pkt = NULL;
-            }
+    while (!atomic_load(&q->abort_request))
+    {
+        int nb = packet_queue_nb_packets(q);
 
-            q->nb_packets--;
-            q->size -= pkt1->pkt.size;
-            *pkt = pkt1->pkt;
-            av_free(pkt1);
-            ret = 1;
-            break;
-        }
-        else if (!block)
+        if (want_space ? nb < PACKET_QUEUE_CAPACITY : nb > 0)
         {
-            ret = 0;
             break;
         }
-        else
-        {
-            SDL_CondWait(q->cond, q->mutex);
-        }
+
+        SDL_CondWait(q->cond, q->mutex);
     }
 
+    atomic_fetch_sub(&q->sleepers, 1);
     SDL_UnlockMutex(q->mutex);
-    return ret;
 }
 
-double get_audio_clock(VideoState *is)
+static void packet_queue_wake(PacketQueue *q)
 {
-    double pts;
-    int hw_buf_size, bytes_per_sec, n;
-
-    pts = is->audio_clock; /* maintained in the audio thread */
-    hw_buf_size = is->audio_buf_size - is->audio_buf_index;
-    bytes_per_sec = 0;
-    n = is->audio_st->codec->channels * 2;
-
-    if (is->audio_st)
+    if (atomic_load(&q->sleepers))
     {
-        bytes_per_sec = is->audio_st->codec->sample_rate * n;
-    }
-
-    if (bytes_per_sec)
-    {
-        pts -= (double)hw_buf_size / bytes_per_sec;
+        SDL_LockMutex(q->mutex);
+        SDL_CondSignal(q->cond);
+        SDL_UnlockMutex(q->mutex);
     }
+}
 
-    return pts;
+/* make every put and get on q fail from now on, and wake whoever sleeps
+   on it */
+static void packet_queue_abort(PacketQueue *q)
+{
+    SDL_LockMutex(q->mutex);
+    atomic_store(&q->abort_request, 1);
+    SDL_CondBroadcast(q->cond);
+    SDL_UnlockMutex(q->mutex);
 }
 
-double get_video_clock(VideoState *is)
+/* once both ends are gone */
+static void packet_queue_destroy(PacketQueue *q)
 {
-    double delta;
+    unsigned int i;
 
-    delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
-    return is->video_current_pts + delta;
+    for (i = atomic_load(&q->head); i != atomic_load(&q->tail); i++)
+    {
+        av_packet_unref(&q->pkts[i & (PACKET_QUEUE_CAPACITY - 1)]);
+    }
+
+    av_freep(&q->pkts);
+    SDL_DestroyMutex(q->mutex);
+    SDL_DestroyCond(q->cond);
 }
 
-double get_external_clock(VideoState *is)
+/* Does q hold enough to keep its decoder busy? A stream we don't play
+   always does. */
+static int packet_queue_has_enough(PacketQueue *q, int stream_index)
 {
-    return av_gettime() / 1000000.0;
+    int64_t duration = atomic_load(&q->duration);
+
+    return stream_index < 0 ||
+           (packet_queue_nb_packets(q) > MIN_FRAMES &&
+            (!duration || av_q2d(q->time_base) * duration > QUEUE_MIN_DURATION));
 }
 
-double get_master_clock(VideoState *is)
+static void demux_wake(DemuxWaiter *w)
 {
-    if (is->av_sync_type == AV_SYNC_VIDEO_MASTER)
-    {
-        return get_video_clock(is);
-    }
-    else if (is->av_sync_type == AV_SYNC_AUDIO_MASTER)
-    {
-        return get_audio_clock(is);
-    }
-    else
+    if (atomic_load(&w->sleeping))
     {
-        return get_external_clock(is);
+        SDL_LockMutex(w->mutex);
+        SDL_CondSignal(w->cond);
+        SDL_UnlockMutex(w->mutex);
     }
 }
 
-/* Add or subtract samples to get a better sync, return new
-   audio buffer size */
-
-int synchronize_audio(VideoState *is, short *samples,
-                      int samples_size, double pts)
+/* Sleep until blocked(is) turns false or we quit. As in
+   packet_queue_wait, sleeping is raised before the queues are looked at,
+   so a consumer either sees it and signals or we see its packet gone. */
+static void demux_wait(VideoState *is, int (*blocked)(VideoState *is))
 {
-    int n;
-    double ref_clock;
+    DemuxWaiter *w = &is->demux_space;
 
-    n = 2 * is->audio_st->codec->channels;
+    SDL_LockMutex(w->mutex);
+    atomic_store(&w->sleeping, 1);
 
-    if (is->av_sync_type != AV_SYNC_AUDIO_MASTER)
+    while (!is->quit && blocked(is))
     {
-        double diff, avg_diff;
-        int wanted_size, min_size, max_size /*, nb_samples */;
+        SDL_CondWait(w->cond, w->mutex);
+    }
 
-        ref_clock = get_master_clock(is);
-        diff = get_audio_clock(is) - ref_clock;
+    atomic_store(&w->sleeping, 0);
+    SDL_UnlockMutex(w->mutex);
+}
 
-        if (diff < AV_NOSYNC_THRESHOLD)
-        {
-            // accumulate the diffs
-            is->audio_diff_cum = diff + is->audio_diff_avg_coef * is->audio_diff_cum;
+static void demux_abort(DemuxWaiter *w)
+{
+    SDL_LockMutex(w->mutex);
+    SDL_CondBroadcast(w->cond);
+    SDL_UnlockMutex(w->mutex);
+}
 
-            if (is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB)
-            {
-                is->audio_diff_avg_count++;
-            }
-            else
-            {
-                avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+/* the first picture shown, or the first sample played if there is no
+   video, counted from when the item was started. It is also main's cue
+   to open the next item of the playlist. */
+static void note_first_frame(VideoState *is)
+{
+    int64_t none = 0;
 
-                if (fabs(avg_diff) >= is->audio_diff_threshold)
-                {
-                    wanted_size = samples_size + ((int)(diff * is->audio_st->codec->sample_rate) * n);
-                    min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-                    max_size = samples_size * ((100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100);
+    if (atomic_compare_exchange_strong(&is->first_frame_time, &none, av_gettime_relative()) &&
+        !headless)
+    {
+        SDL_Event event;
 
-                    if (wanted_size < min_size)
-                    {
-                        wanted_size = min_size;
-                    }
-                    else if (wanted_size > max_size)
-                    {
-                        wanted_size = max_size;
-                    }
+        event.type = FF_FIRST_FRAME_EVENT;
+        event.user.data1 = is;
+        event.user.code = is->generation;
+        SDL_PushEvent(&event);
+    }
+}
 
-                    if (wanted_size < samples_size)
-                    {
-                        /* remove samples */
-                        samples_size = wanted_size;
-                    }
-                    else if (wanted_size > samples_size)
-                    {
-                        uint8_t *samples_end, *q;
-                        int nb;
+/* Tell every thread of is to stop, and wake the ones asleep. */
+static void stream_abort(VideoState *is)
+{
+    is->quit = 1;
+    packet_queue_abort(&is->audioq);
+    packet_queue_abort(&is->videoq);
+    demux_abort(&is->demux_space);
 
-                        /* add samples by copying final sample*/
-                        nb = (samples_size - wanted_size);
-                        samples_end = (uint8_t *)samples + samples_size - n;
-                        q = samples_end + n;
+    SDL_LockMutex(is->pictq_mutex);
+    SDL_CondBroadcast(is->pictq_cond);
+    SDL_UnlockMutex(is->pictq_mutex);
 
-                        while (nb > 0)
-                        {
-                            memcpy(q, samples_end, n);
-                            q += n;
-                            nb -= n;
-                        }
+    if (is->readahead)
+    {
+        SDL_LockMutex(is->readahead->mutex);
+        SDL_CondBroadcast(is->readahead->cond);
+        SDL_UnlockMutex(is->readahead->mutex);
+    }
 
-                        samples_size = wanted_size;
-                    }
-                }
-            }
-        }
-        else
-        {
-            /* difference is TOO big; reset diff stuff */
-            is->audio_diff_avg_count = 0;
-            is->audio_diff_cum = 0;
-        }
+    if (is->audio_ring.space)
+    {
+        SDL_SemPost(is->audio_ring.space);
     }
 
-    return samples_size;
+    SDL_SemPost(is->stats_wake);
 }
 
-long audio_tutorial_resample(VideoState *is, struct AVFrame *inframe)
+/* decode_thread waits for this once the input is exhausted */
+static void stream_finished(VideoState *is, atomic_int *finished, int serial)
 {
+    atomic_store(finished, serial);
+    demux_wake(&is->demux_space);
+}
 
-    uint8_t **resample_input_bytes = (uint8_t **)inframe->extended_data;
-
-    int resample_nblen = 0;
-    long resample_long_bytes = 0;
+/* Takes ownership of pkt. Packets the demuxer handed out with a buffer
+   reference are moved into the ring as-is, so the payload travels to the
+   decoder without being copied; only non-refcounted packets pay for a
+   copy, which is accounted in bytes_copied. */
+int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+{
+    unsigned int tail;
 
-    if (is->pResampledOut == NULL || inframe->nb_samples > is->resample_size)
+    if (!pkt->buf && pkt->data && pkt->data != flush_pkt.data)
     {
+        AVPacket ref;
+
+        if (av_packet_ref(&ref, pkt) < 0)
+        {
+            av_packet_unref(pkt);
+            return -1;
+        }
+
+        q->bytes_copied += pkt->size;
+        av_packet_unref(pkt);
+        av_packet_move_ref(pkt, &ref);
+    }
 
-        is->resample_size = av_rescale_rnd(swr_get_delay(is->pSwrCtx,
-                                                         44100) +
-                                               inframe->nb_samples,
-                                           44100,
-                                           44100,
-                                           AV_ROUND_UP);
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
 
-        if (is->pResampledOut != NULL)
+    while (tail - atomic_load(&q->head) >= PACKET_QUEUE_CAPACITY)
+    {
+        if (atomic_load(&q->abort_request))
         {
-            av_free(is->pResampledOut);
-            is->pResampledOut = NULL;
+            av_packet_unref(pkt);
+            return -1;
         }
 
-        av_samples_alloc(&is->pResampledOut, &is->resample_lines, 2, is->resample_size,
-                         AV_SAMPLE_FMT_S16, 0);
+        packet_queue_wait(q, 1);
     }
 
-    // SWResample
-    resample_nblen = swr_convert(is->pSwrCtx, (uint8_t **)&is->pResampledOut,
-                                 is->resample_size,
-                                 (const uint8_t **)resample_input_bytes, inframe->nb_samples);
+    atomic_fetch_add(&q->size, pkt->size);
+    atomic_fetch_add(&q->duration, pkt->duration);
+    av_packet_move_ref(&q->pkts[tail & (PACKET_QUEUE_CAPACITY - 1)], pkt);
+    atomic_store(&q->tail, tail + 1);
+
+    packet_queue_wake(q);
+    return 0;
+}
 
-    resample_long_bytes = av_samples_get_buffer_size(NULL, 2, resample_nblen,
-                                                     AV_SAMPLE_FMT_S16, 1);
+/* the end-of-stream marker: an empty packet, which also tells the
+   decoder to return the frames it still holds */
+static void packet_queue_put_eos(PacketQueue *q, int stream_index)
+{
+    AVPacket pkt;
 
-    if (resample_nblen < 0)
+    if (stream_index < 0)
     {
-        fprintf(stderr, "reSample to another sample format failed!\n");
-        return -1;
+        return;
     }
 
-    return resample_long_bytes;
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    pkt.stream_index = stream_index;
+    packet_queue_put(q, &pkt);
 }
 
-int audio_decode_frame(VideoState *is, double *pts_ptr)
+/* Queued after a seek. The packets in front of it are from the old
+   position, so the consumer drops them without decoding, and on taking
+   it flushes its decoder. */
+static void packet_queue_put_flush(PacketQueue *q, int stream_index)
 {
-    /* For example with wma audio package size can be
-       like 100 000 bytes */
-    long len1, data_size = 0;
-    AVPacket *pkt = &is->audio_pkt;
-    double pts;
-    int n = 0;
-
-    long resample_size = 0;
+    AVPacket pkt;
 
-    for (;;)
+    if (stream_index < 0)
     {
-        while (is->audio_pkt_size > 0)
-        {
-            int got_frame = 0;
-            len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
-
-            if (len1 < 0)
-            {
-                /* if error, skip frame */
-                is->audio_pkt_size = 0;
-                break;
-            }
-
-            if (got_frame)
-            {
-                data_size =
-                    av_samples_get_buffer_size(
-                        NULL,
-                        is->audio_st->codec->channels,
-                        is->audio_frame.nb_samples,
-                        is->audio_st->codec->sample_fmt,
-                        1);
+        return;
+    }
 
-                if (data_size <= 0)
-                {
-                    /* No data yet, get more frames */
-                    continue;
-                }
+    pkt = flush_pkt;
+    pkt.stream_index = stream_index;
+    atomic_fetch_add(&q->flushes, 1);
+    packet_queue_put(q, &pkt);
+}
 
-                if (is->audio_need_resample == 1)
-                {
-                    resample_size = audio_tutorial_resample(is, &is->audio_frame);
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+{
+    unsigned int head;
 
-                    if (resample_size > 0)
-                    {
-                        memcpy(is->audio_buf, is->pResampledOut, resample_size);
-                        memset(is->pResampledOut, 0x00, resample_size);
-                    }
-                }
-                else
-                {
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
 
-                    memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
-                }
-            }
+    for (;;)
+    {
+        if (atomic_load(&q->abort_request))
+        {
+            return -1;
+        }
 
-            is->audio_pkt_data += len1;
-            is->audio_pkt_size -= len1;
+        if (atomic_load(&q->tail) != head)
+        {
+            av_packet_move_ref(pkt, &q->pkts[head & (PACKET_QUEUE_CAPACITY - 1)]);
+            atomic_fetch_sub(&q->size, pkt->size);
+            atomic_fetch_sub(&q->duration, pkt->duration);
+            atomic_store(&q->head, head + 1);
 
-            pts = is->audio_clock;
-            *pts_ptr = pts;
-            n = 2 * is->audio_st->codec->channels;
+            packet_queue_wake(q);
 
-            /* If you just return original data_size you will suffer
-               for clicks because you don't have that much data in
-               queue incoming so return resampled size. */
-            if (is->audio_need_resample == 1)
+            if (q->space)
             {
-                is->audio_clock += (double)resample_size /
-                                   (double)(n * is->audio_st->codec->sample_rate);
-                return resample_size;
+                demux_wake(q->space);
             }
-            else
+
+            if (atomic_load(&q->flushes) > 0)
             {
+                if (pkt->data != flush_pkt.data)
+                {
+                    av_packet_unref(pkt);
+                    head++;
+                    continue;
+                }
 
-                /* We have data, return it and come back for more later */
-                is->audio_clock += (double)data_size /
-                                   (double)(n * is->audio_st->codec->sample_rate);
-                return data_size;
+                atomic_fetch_sub(&q->flushes, 1);
             }
-        }
 
-        if (pkt->data)
-        {
-            av_free_packet(pkt);
+            return 1;
         }
-
-        if (is->quit)
+        else if (!block)
         {
-            return -1;
+            return 0;
         }
-
-        /* next packet */
-        if (packet_queue_get(&is->audioq, pkt, 1) < 0)
+        else
         {
-            return -1;
+            packet_queue_wait(q, 0);
         }
+    }
+}
 
-        is->audio_pkt_data = pkt->data;
-        is->audio_pkt_size = pkt->size;
+static int audio_ring_init(AudioRing *r, int frame_bytes, unsigned int min_size)
+{
+    unsigned int size = 1024 * frame_bytes;
 
-        /* if update, update the audio clock w/pts */
-        if (pkt->pts != AV_NOPTS_VALUE)
-        {
-            is->audio_clock = av_q2d(is->audio_st->time_base) * pkt->pts;
-        }
+    while (size < min_size)
+    {
+        size *= 2;
+    }
+
+    r->buf = av_malloc(size);
+
+    if (!r->buf)
+    {
+        return -1;
     }
+
+    r->size = size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->eof, 0);
+    atomic_init(&r->waiting, 0);
+    r->space = SDL_CreateSemaphore(0);
+    return 0;
 }
 
-void audio_callback(void *userdata, Uint8 *stream, int len)
+static unsigned int audio_ring_fill(AudioRing *r)
+{
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+           atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/* The free space after the write position, up to the end of buf.
+   Bytes written there are only seen by the reader once committed. */
+static uint8_t *audio_ring_reserve(AudioRing *r, unsigned int *len)
 {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    unsigned int off = head % r->size;
 
-    VideoState *is = (VideoState *)userdata;
-    long len1, audio_size;
-    double pts;
+    *len = FFMIN(r->size - (unsigned int)(head - tail), r->size - off);
+    return r->buf + off;
+}
+
+static void audio_ring_commit(AudioRing *r, unsigned int len)
+{
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+}
+
+/* copy up to len bytes out, returns how many there were */
+static unsigned int audio_ring_read(AudioRing *r, uint8_t *data, unsigned int len)
+{
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    unsigned int off = tail % r->size;
+    unsigned int n = FFMIN(len, (unsigned int)(head - tail));
+    unsigned int first = FFMIN(n, r->size - off);
+
+    memcpy(data, r->buf + off, first);
+    memcpy(data + first, r->buf, n - first);
+
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return n;
+}
+
+/* Wait for room in the ring. Returns the contiguous free space, or 0
+   once we are quitting. In headless mode nothing reads the ring, so
+   whatever is in it is dropped instead. */
+static uint8_t *audio_ring_wait(VideoState *is, AudioRing *r, unsigned int *len)
+{
+    uint8_t *p;
 
-    while (len > 0)
+    while (!is->quit)
     {
-        if (is->audio_buf_index >= is->audio_buf_size)
+        if (headless)
         {
-            /* We have already sent all our data; get more */
-            audio_size = audio_decode_frame(is, &pts);
+            atomic_store_explicit(&r->tail, atomic_load_explicit(&r->head, memory_order_relaxed),
+                                  memory_order_release);
+        }
 
-            if (audio_size < 0)
-            {
-                /* If error, output silence */
-                is->audio_buf_size = 1024;
-                memset(is->audio_buf, 0, is->audio_buf_size);
-            }
-            else
-            {
-                audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
-                                               audio_size, pts);
-                is->audio_buf_size = audio_size;
-            }
+        p = audio_ring_reserve(r, len);
 
-            is->audio_buf_index = 0;
+        if (*len)
+        {
+            return p;
         }
 
-        len1 = is->audio_buf_size - is->audio_buf_index;
+        /* the callback may have read between the reserve and here,
+           so look again after saying we wait */
+        atomic_store(&r->waiting, 1);
 
-        if (len1 > len)
+        if (audio_ring_fill(r) == r->size)
         {
-            len1 = len;
+            SDL_SemWaitTimeout(r->space, 100);
         }
 
-        memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-        len -= len1;
-        stream += len1;
-        is->audio_buf_index += len1;
+        atomic_store(&r->waiting, 0);
     }
+
+    *len = 0;
+    return NULL;
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque)
+double get_audio_clock(VideoState *is)
 {
-    SDL_Event event;
-    event.type = FF_REFRESH_EVENT;
-    event.user.data1 = opaque;
-    SDL_PushEvent(&event);
-    return 0; /* 0 means stop timer */
+    double pts;
+    int hw_buf_size, bytes_per_sec, n;
+
+    pts = is->audio_ring_clock; /* maintained in the audio thread */
+    /* still to be played: the ring, and the buffer the device is on */
+    hw_buf_size = audio_ring_fill(&is->audio_ring) + is->audio_hw_buf_size;
+    bytes_per_sec = 0;
+    n = is->audio_frame_bytes;
+
+    if (is->audio_st)
+    {
+        bytes_per_sec = is->audio_out_rate * n;
+    }
+
+    if (bytes_per_sec)
+    {
+        pts -= (double)hw_buf_size / bytes_per_sec;
+    }
+
+    return pts;
+}
+
+double get_video_clock(VideoState *is)
+{
+    double delta;
+
+    delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
+    return is->video_current_pts + delta;
 }
 
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay)
+double get_external_clock(VideoState *is)
 {
-    SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+    return av_gettime() / 1000000.0;
 }
 
-void video_display(VideoState *is)
+double get_master_clock(VideoState *is)
 {
+    if (is->av_sync_type == AV_SYNC_VIDEO_MASTER)
+    {
+        return get_video_clock(is);
+    }
+    else if (is->av_sync_type == AV_SYNC_AUDIO_MASTER)
+    {
+        return get_audio_clock(is);
+    }
+    else
+    {
+        return get_external_clock(is);
+    }
+}
 
-    SDL_Rect rect;
-    VideoPicture *vp;
-    //AVPicture pict;
-    float aspect_ratio;
-    int w, h, x, y;
-    //int i;
+static int audio_open_resampler(VideoState *is, AVCodecContext *codecCtx);
 
-    vp = &is->pictq[is->pictq_rindex];
+/* Add or subtract samples to get a better sync. Rather than cutting the
+   frame short or repeating its last sample, which clicks, swresample
+   stretches or squeezes the next nb_samples output samples by up to
+   SAMPLE_CORRECTION_PERCENT_MAX. A frame that would not otherwise need
+   resampling is switched over to swresample the first time. */
 
-    if (vp->bmp)
+void synchronize_audio(VideoState *is, int nb_samples)
+{
+    double ref_clock;
+
+    if (is->av_sync_type != AV_SYNC_AUDIO_MASTER)
     {
-        if (is->video_st->codec->sample_aspect_ratio.num == 0)
+        double diff, avg_diff;
+        int wanted_nb, min_nb, max_nb;
+
+        ref_clock = get_master_clock(is);
+        diff = get_audio_clock(is) - ref_clock;
+
+        if (fabs(diff) < AV_NOSYNC_THRESHOLD)
         {
-            aspect_ratio = 0;
+            // accumulate the diffs
+            is->audio_diff_cum = diff + is->audio_diff_avg_coef * is->audio_diff_cum;
+
+            if (is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB)
+            {
+                is->audio_diff_avg_count++;
+            }
+            else
+            {
+                avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+
+                if (fabs(avg_diff) >= is->audio_diff_threshold)
+                {
+                    wanted_nb = nb_samples + (int)(diff * is->audio_out_rate);
+                    min_nb = nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+                    max_nb = nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+                    wanted_nb = av_clip(wanted_nb, min_nb, max_nb);
+
+                    if (wanted_nb != nb_samples &&
+                        (is->audio_convert == AUDIO_CONVERT_SWR ||
+                         audio_open_resampler(is, is->audio_st->codec) == 0))
+                    {
+                        if (swr_set_compensation(is->pSwrCtx, wanted_nb - nb_samples, wanted_nb) < 0)
+                        {
+                            fprintf(stderr, "swr_set_compensation() failed\n");
+                        }
+
+                        is->audio_compensations++;
+                    }
+                }
+            }
         }
         else
         {
-            aspect_ratio = av_q2d(is->video_st->codec->sample_aspect_ratio) *
-                           is->video_st->codec->width / is->video_st->codec->height;
+            /* difference is TOO big; reset diff stuff */
+            is->audio_diff_avg_count = 0;
+            is->audio_diff_cum = 0;
         }
+    }
+}
 
-        if (aspect_ratio <= 0.0)
-        {
-            aspect_ratio = (float)is->video_st->codec->width /
-                           (float)is->video_st->codec->height;
-        }
+/* After a seek: forget the old position's samples in the decoder, swr
+   and the ring. The callback is locked out while the ring's read side
+   is moved up to the write side. */
+static void audio_flush(VideoState *is)
+{
+    AudioRing *r = &is->audio_ring;
 
-        h = screen->h;
-        w = ((int)rint(h * aspect_ratio)) & -3;
+    avcodec_flush_buffers(is->audio_st->codec);
+    is->audio_pkt_size = 0;
+    is->audio_draining = 0;
 
-        if (w > screen->w)
-        {
-            w = screen->w;
-            h = ((int)rint(w / aspect_ratio)) & -3;
-        }
+    if (is->pSwrCtx)
+    {
+        swr_init(is->pSwrCtx);
+    }
 
-        x = (screen->w - w) / 2;
-        y = (screen->h - h) / 2;
+    is->audio_serial = atomic_load(&is->seek_serial);
+    is->audio_skip_until = is->seek_target;
+    is->audio_diff_avg_count = 0;
+    is->audio_diff_cum = 0;
 
-        rect.x = x;
-        rect.y = y;
-        rect.w = w;
-        rect.h = h;
-        SDL_DisplayYUVOverlay(vp->bmp, &rect);
-    }
+    SDL_LockAudio();
+    atomic_store(&r->tail, atomic_load(&r->head));
+    atomic_store(&r->eof, 0);
+    SDL_UnlockAudio();
 }
 
-void video_refresh_timer(void *userdata)
+int audio_decode_frame(VideoState *is, double *pts_ptr)
 {
+    /* For example with wma audio package size can be
+       like 100 000 bytes */
+    long len1, data_size = 0;
+    AVPacket *pkt = &is->audio_pkt;
+    double pts;
 
-    VideoState *is = (VideoState *)userdata;
-    VideoPicture *vp;
-    double actual_delay, delay, sync_threshold, ref_clock, diff;
-
-    if (is->video_st)
+    for (;;)
     {
-        if (is->pictq_size == 0)
+        while (is->audio_pkt_size > 0 || is->audio_draining)
         {
-            schedule_refresh(is, 1);
-        }
-        else
-        {
-            vp = &is->pictq[is->pictq_rindex];
-
-            is->video_current_pts = vp->pts;
-            is->video_current_pts_time = av_gettime();
-
-            delay = vp->pts - is->frame_last_pts; /* the pts from last time */
+            int got_frame = 0;
+            int64_t t = av_gettime_relative();
+            len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
+            histogram_add(&is->stage_hist[STAGE_AUDIO_DECODE], av_gettime_relative() - t);
 
-            if (delay <= 0 || delay >= 1.0)
+            if (is->audio_draining && (len1 < 0 || !got_frame))
             {
-                /* if incorrect delay, use previous one */
-                delay = is->frame_last_delay;
+                /* the decoder has given back everything it held */
+                is->audio_draining = 0;
+                av_packet_unref(pkt);
+                return AVERROR_EOF;
             }
 
-            /* save for next time */
-            is->frame_last_delay = delay;
-            is->frame_last_pts = vp->pts;
-
-            /* update delay to sync to audio if not master source */
-            if (is->av_sync_type != AV_SYNC_VIDEO_MASTER)
+            if (len1 < 0)
             {
-                ref_clock = get_master_clock(is);
-                diff = vp->pts - ref_clock;
+                /* if error, skip frame */
+                is->audio_pkt_size = 0;
+                break;
+            }
 
-                /* Skip or repeat the frame. Take delay into account
-                   FFPlay still doesn't "know if this is the best guess." */
-                sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
+            if (got_frame)
+            {
+                is->audio_samples += is->audio_frame.nb_samples;
+                data_size =
+                    av_samples_get_buffer_size(
+                        NULL,
+                        is->audio_st->codec->channels,
+                        is->audio_frame.nb_samples,
+                        is->audio_st->codec->sample_fmt,
+                        1);
 
-                if (fabs(diff) < AV_NOSYNC_THRESHOLD)
+                if (data_size <= 0)
                 {
-                    if (diff <= -sync_threshold)
-                    {
-                        delay = 0;
-                    }
-                    else if (diff >= sync_threshold)
-                    {
-                        delay = 2 * delay;
-                    }
+                    /* No data yet, get more frames */
+                    continue;
                 }
             }
 
-            is->frame_timer += delay;
-            /* computer the REAL delay */
-            actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
+            if (!is->audio_draining)
+            {
+                is->audio_pkt_data += len1;
+                is->audio_pkt_size -= len1;
+            }
 
-            if (actual_delay < 0.010)
+            if (!got_frame)
             {
-                /* Really it should skip the picture instead */
-                actual_delay = 0.010;
+                continue;
             }
 
-            schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
+            pts = is->audio_clock;
+            *pts_ptr = pts;
 
-            /* show the picture! */
-            video_display(is);
+            /* The samples stay in is->audio_frame, audio_thread writes
+               them to the ring from there */
+            is->audio_clock += (double)is->audio_frame.nb_samples /
+                               is->audio_st->codec->sample_rate;
+            return data_size;
+        }
 
-            /* update queue for next picture! */
-            if (++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE)
-            {
-                is->pictq_rindex = 0;
-            }
+        if (pkt->data)
+        {
+            av_packet_unref(pkt);
+        }
 
-            SDL_LockMutex(is->pictq_mutex);
-            is->pictq_size--;
-            SDL_CondSignal(is->pictq_cond);
-            SDL_UnlockMutex(is->pictq_mutex);
+        if (is->quit)
+        {
+            return -1;
         }
-    }
+
+        /* next packet */
+        if (packet_queue_get(&is->audioq, pkt, 1) < 0)
+        {
+            return -1;
+        }
+
+        gauge_update(&is->gauges[GAUGE_AUDIOQ_PACKETS], packet_queue_nb_packets(&is->audioq));
+        gauge_update(&is->gauges[GAUGE_AUDIOQ_BYTES], is->audioq.size);
+
+        if (pkt->data == flush_pkt.data)
+        {
+            audio_flush(is);
+            continue;
+        }
+
+        is->audio_pkt_data = pkt->data;
+        is->audio_pkt_size = pkt->size;
+        is->audio_draining = !pkt->data;
+
+        /* if update, update the audio clock w/pts */
+        if (pkt->pts != AV_NOPTS_VALUE)
+        {
+            is->audio_clock = av_q2d(is->audio_st->time_base) * pkt->pts;
+        }
+    }
+}
+
+/* From the callback: the last sample of is has been played. Finishing
+   the stream wakes the demuxer, which takes a lock, so it is left to
+   audio_thread, waiting for this in audio_wait_played_out. */
+static void audio_mark_played_out(VideoState *is)
+{
+    atomic_store(&is->audio_played_out, atomic_load(&is->audio_eos));
+    SDL_SemPost(is->audio_ring.space);
+}
+
+/* Take what the ring of is has, up to len bytes, and silence for the
+   rest. Returns the bytes that came from the ring. */
+static int audio_play(VideoState *is, Uint8 *stream, int len)
+{
+    int len1;
+    int64_t t = av_gettime_relative();
+
+    len1 = audio_ring_read(&is->audio_ring, stream, len);
+    atomic_fetch_add(&is->audio_bytes_touched, 2 * len1 + (len - len1));
+
+    if (len1 && !is->video_st)
+    {
+        /* the first sample: audio_thread sends main the event */
+        int64_t none = 0;
+
+        atomic_compare_exchange_strong(&is->first_frame_time, &none, av_gettime_relative());
+    }
+
+    if (len1 < len)
+    {
+        memset(stream + len1, 0, len - len1);
+
+        /* running dry before the first samples or after the last is
+           not an underrun */
+        if (atomic_load(&is->audio_ring.head) && !atomic_load(&is->audio_ring.eof))
+        {
+            is->audio_underruns++;
+        }
+    }
+
+    /* the buffer before this one held the last sample */
+    if (!len1 && atomic_load(&is->audio_ring.eof) &&
+        atomic_load(&is->audio_played_out) != atomic_load(&is->audio_eos))
+    {
+        audio_mark_played_out(is);
+    }
+
+    if (len1 && atomic_exchange(&is->audio_ring.waiting, 0))
+    {
+        SDL_SemPost(is->audio_ring.space);
+    }
+    histogram_add(&is->stage_hist[STAGE_AUDIO_CALLBACK], av_gettime_relative() - t);
+    return len1;
+}
+
+/* Runs on SDL's audio thread, which must never wait: no locks and no
+   events from here, only atomics and posting audio_ring.space. */
+void audio_callback(void *userdata, Uint8 *stream, int len)
+{
+
+    VideoState *is, *next;
+    int i, len1;
+
+    if (nb_mosaic && audio_tile < 0)
+    {
+        /* -audio mix: every tile, added up and clipped by SDL */
+        memset(stream, 0, len);
+
+        for (i = 0; i < nb_mosaic; i++)
+        {
+            is = mosaic[i];
+
+            if (is && atomic_load(&is->audio_ready) && len <= audio_device_spec.size)
+            {
+                audio_play(is, audio_mix_buf, len);
+                SDL_MixAudio(stream, audio_mix_buf, len, SDL_MIX_MAXVOLUME);
+            }
+        }
+
+        return;
+    }
+
+    is = atomic_load(&audio_source);
+
+    if (!is || !atomic_load(&is->audio_ready))
+    {
+        memset(stream, 0, len);
+        return;
+    }
+
+    len1 = audio_play(is, stream, len);
+
+    /* The item is over once its last sample is in this buffer and its
+       last picture is shown: fill the rest with the next item's first
+       samples instead of a buffer of silence. */
+    next = atomic_load(&audio_next);
+
+    if (len1 < len && next && next != is && atomic_load(&next->audio_ready) &&
+        atomic_load(&is->audio_ring.eof) && !audio_ring_fill(&is->audio_ring) &&
+        (is->videoStream < 0 ||
+         atomic_load(&is->video_finished) == atomic_load(&is->seek_serial)) &&
+        atomic_compare_exchange_strong(&audio_source, &is, next))
+    {
+        audio_mark_played_out(is);
+        atomic_compare_exchange_strong(&audio_next, &next, NULL);
+        audio_play(next, stream + len1, len - len1);
+    }
+}
+
+/* microseconds on the clock the presentation thread sleeps on */
+static int64_t monotonic_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* sleep until an absolute monotonic_time() deadline */
+static void sleep_until(int64_t deadline)
+{
+#ifdef TIMER_ABSTIME
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+#else
+    int64_t now = monotonic_time();
+
+    if (deadline > now)
+    {
+        av_usleep(deadline - now);
+    }
+#endif
+}
+
+/* Repack kernels for decoder outputs that only need their planes
+   rearranged to become YV12: NV12 (interleaved chroma), YUVJ420P (full
+   range) and YUV420P. The row functions are picked once by
+   repack_init() from the CPU flags; anything else goes through swscale. */
+typedef struct RepackKernels
+{
+    const char *name;
+    void (*deinterleave_uv)(uint8_t *u, uint8_t *v, const uint8_t *uv, int n);
+    void (*range_luma)(uint8_t *dst, const uint8_t *src, int n);
+    void (*range_chroma)(uint8_t *dst, const uint8_t *src, int n);
+} RepackKernels;
+
+/* Full to limited range, exact for 8 bits: x / 255 computed as
+   (x + 1 + (x >> 8)) >> 8 for x < 65536.
+   luma:   16 + round(y * 219 / 255) = (y * 219 + 127 + 16 * 255) / 255
+   chroma: 128 + round((c - 128) * 224 / 255) = (c * 224 + 4095) / 255 */
+#define RANGE_LUMA_MUL 219
+#define RANGE_LUMA_ADD 4207
+#define RANGE_CHROMA_MUL 224
+#define RANGE_CHROMA_ADD 4095
+
+static void deinterleave_uv_c(uint8_t *u, uint8_t *v, const uint8_t *uv, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        u[i] = uv[2 * i];
+        v[i] = uv[2 * i + 1];
+    }
+}
+
+static inline uint8_t range_pixel(int x, int mul, int add)
+{
+    int t = x * mul + add;
+    return (t + 1 + (t >> 8)) >> 8;
+}
+
+static void range_luma_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        dst[i] = range_pixel(src[i], RANGE_LUMA_MUL, RANGE_LUMA_ADD);
+    }
+}
+
+static void range_chroma_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        dst[i] = range_pixel(src[i], RANGE_CHROMA_MUL, RANGE_CHROMA_ADD);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static void deinterleave_uv_sse2(uint8_t *u, uint8_t *v, const uint8_t *uv, int n)
+{
+    const __m128i lo = _mm_set1_epi16(0x00ff);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+
+        _mm_storeu_si128((__m128i *)(u + i),
+                         _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo)));
+        _mm_storeu_si128((__m128i *)(v + i),
+                         _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+
+    deinterleave_uv_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+__attribute__((target("sse2"))) static inline __m128i range_sse2(__m128i x, __m128i mul, __m128i add)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, mul), add);
+    t = _mm_add_epi16(t, _mm_add_epi16(_mm_set1_epi16(1), _mm_srli_epi16(t, 8)));
+    return _mm_srli_epi16(t, 8);
+}
+
+__attribute__((target("sse2"))) static void range_sse2_row(uint8_t *dst, const uint8_t *src, int n, int m, int a)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul = _mm_set1_epi16(m);
+    const __m128i add = _mm_set1_epi16(a);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = range_sse2(_mm_unpacklo_epi8(x, zero), mul, add);
+        __m128i h = range_sse2(_mm_unpackhi_epi8(x, zero), mul, add);
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(l, h));
+    }
+
+    for (; i < n; i++)
+    {
+        dst[i] = range_pixel(src[i], m, a);
+    }
+}
+
+static void range_luma_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    range_sse2_row(dst, src, n, RANGE_LUMA_MUL, RANGE_LUMA_ADD);
+}
+
+static void range_chroma_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    range_sse2_row(dst, src, n, RANGE_CHROMA_MUL, RANGE_CHROMA_ADD);
+}
+
+__attribute__((target("avx2"))) static void deinterleave_uv_avx2(uint8_t *u, uint8_t *v, const uint8_t *uv, int n)
+{
+    const __m256i lo = _mm256_set1_epi16(0x00ff);
+    int i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(uv + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 2 * i + 32));
+        /* packus works per 128-bit lane, put the quadwords back in order */
+        __m256i pu = _mm256_packus_epi16(_mm256_and_si256(a, lo), _mm256_and_si256(b, lo));
+        __m256i pv = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+
+        _mm256_storeu_si256((__m256i *)(u + i), _mm256_permute4x64_epi64(pu, 0xd8));
+        _mm256_storeu_si256((__m256i *)(v + i), _mm256_permute4x64_epi64(pv, 0xd8));
+    }
+
+    deinterleave_uv_sse2(u + i, v + i, uv + 2 * i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i range_avx2(__m256i x, __m256i mul, __m256i add)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, mul), add);
+    t = _mm256_add_epi16(t, _mm256_add_epi16(_mm256_set1_epi16(1), _mm256_srli_epi16(t, 8)));
+    return _mm256_srli_epi16(t, 8);
+}
+
+__attribute__((target("avx2"))) static void range_avx2_row(uint8_t *dst, const uint8_t *src, int n, int m, int a)
+{
+    const __m256i mul = _mm256_set1_epi16(m);
+    const __m256i add = _mm256_set1_epi16(a);
+    int i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = range_avx2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(x)), mul, add);
+        __m256i h = range_avx2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1)), mul, add);
+
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(l, h), 0xd8));
+    }
+
+    range_sse2_row(dst + i, src + i, n - i, m, a);
+}
+
+static void range_luma_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    range_avx2_row(dst, src, n, RANGE_LUMA_MUL, RANGE_LUMA_ADD);
+}
+
+static void range_chroma_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    range_avx2_row(dst, src, n, RANGE_CHROMA_MUL, RANGE_CHROMA_ADD);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static void deinterleave_uv_neon(uint8_t *u, uint8_t *v, const uint8_t *uv, int n)
+{
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        uint8x16x2_t p = vld2q_u8(uv + 2 * i);
+
+        vst1q_u8(u + i, p.val[0]);
+        vst1q_u8(v + i, p.val[1]);
+    }
+
+    deinterleave_uv_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+static inline uint8x8_t range_neon(uint8x8_t x, uint16x8_t mul, uint16x8_t add)
+{
+    uint16x8_t t = vmlaq_u16(add, vmovl_u8(x), mul);
+    t = vaddq_u16(t, vaddq_u16(vdupq_n_u16(1), vshrq_n_u16(t, 8)));
+    return vshrn_n_u16(t, 8);
+}
+
+static void range_neon_row(uint8_t *dst, const uint8_t *src, int n, int m, int a)
+{
+    const uint16x8_t mul = vdupq_n_u16(m);
+    const uint16x8_t add = vdupq_n_u16(a);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        uint8x16_t x = vld1q_u8(src + i);
+
+        vst1q_u8(dst + i, vcombine_u8(range_neon(vget_low_u8(x), mul, add),
+                                      range_neon(vget_high_u8(x), mul, add)));
+    }
+
+    for (; i < n; i++)
+    {
+        dst[i] = range_pixel(src[i], m, a);
+    }
+}
+
+static void range_luma_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    range_neon_row(dst, src, n, RANGE_LUMA_MUL, RANGE_LUMA_ADD);
+}
+
+static void range_chroma_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    range_neon_row(dst, src, n, RANGE_CHROMA_MUL, RANGE_CHROMA_ADD);
+}
+#endif
+
+static RepackKernels repack = {"c", deinterleave_uv_c, range_luma_c, range_chroma_c};
+
+static void repack_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    int flags = av_get_cpu_flags();
+
+    if (flags & AV_CPU_FLAG_AVX2)
+    {
+        repack = (RepackKernels){"avx2", deinterleave_uv_avx2, range_luma_avx2, range_chroma_avx2};
+    }
+    else if (flags & AV_CPU_FLAG_SSE2)
+    {
+        repack = (RepackKernels){"sse2", deinterleave_uv_sse2, range_luma_sse2, range_chroma_sse2};
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_NEON)
+    {
+        repack = (RepackKernels){"neon", deinterleave_uv_neon, range_luma_neon, range_chroma_neon};
+    }
+#endif
+}
+
+/* Same-size plane copy. Plain memcpy: libc already uses the widest
+   vector moves the CPU has, and one call covers the whole plane when the
+   strides agree. */
+static void copy_plane(uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                       int width, int height)
+{
+    if (dst_linesize == src_linesize && dst_linesize == width)
+    {
+        memcpy(dst, src, (size_t)width * height);
+        return;
+    }
+
+    for (; height > 0; height--)
+    {
+        memcpy(dst, src, width);
+        dst += dst_linesize;
+        src += src_linesize;
+    }
+}
+
+/* Repack src into the three planes of a YV12 picture of the same size
+   (dst[1] = U, dst[2] = V, as queue_picture points them). Returns -1 for
+   anything that needs swscale. */
+static int repack_picture(AVFrame *src, uint8_t *const dst[3], const int dst_linesize[3],
+                          int width, int height)
+{
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    int y;
+
+    if (src->width != width || src->height != height)
+    {
+        return -1;
+    }
+
+    switch (src->format)
+    {
+    case AV_PIX_FMT_YUV420P:
+        copy_plane(dst[0], dst_linesize[0], src->data[0], src->linesize[0], width, height);
+        copy_plane(dst[1], dst_linesize[1], src->data[1], src->linesize[1], cw, ch);
+        copy_plane(dst[2], dst_linesize[2], src->data[2], src->linesize[2], cw, ch);
+        return 0;
+
+    case AV_PIX_FMT_NV12:
+        copy_plane(dst[0], dst_linesize[0], src->data[0], src->linesize[0], width, height);
+
+        for (y = 0; y < ch; y++)
+        {
+            repack.deinterleave_uv(dst[1] + y * dst_linesize[1], dst[2] + y * dst_linesize[2],
+                                   src->data[1] + y * src->linesize[1], cw);
+        }
+        return 0;
+
+    case AV_PIX_FMT_YUVJ420P:
+        for (y = 0; y < height; y++)
+        {
+            repack.range_luma(dst[0] + y * dst_linesize[0], src->data[0] + y * src->linesize[0], width);
+        }
+
+        for (y = 0; y < ch; y++)
+        {
+            repack.range_chroma(dst[1] + y * dst_linesize[1], src->data[1] + y * src->linesize[1], cw);
+            repack.range_chroma(dst[2] + y * dst_linesize[2], src->data[2] + y * src->linesize[2], cw);
+        }
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/* Sample kernels for the decoder outputs that only need interleaving
+   to become what the sound card plays: planar float (AAC, Vorbis, Opus)
+   and planar s16, at the device's own rate and channel count. Stereo
+   and mono get vector loops, other layouts the C one. Picked once by
+   sample_convert_init() like the repack kernels; rate or layout changes
+   still go through swresample. */
+typedef struct SampleKernels
+{
+    const char *name;
+    void (*fltp_to_s16)(int16_t *dst, const float *const *src, int channels, int n);
+    void (*s16p_to_s16)(int16_t *dst, const int16_t *const *src, int channels, int n);
+} SampleKernels;
+
+/* round to nearest like lrintf, saturating like the vector packs */
+static inline int16_t flt_to_s16(float x)
+{
+    x *= 32768.0f;
+    x = x < -32768.0f ? -32768.0f : x > 32767.0f ? 32767.0f : x;
+    return (int16_t)lrintf(x);
+}
+
+static void fltp_to_s16_c(int16_t *dst, const float *const *src, int channels, int n)
+{
+    int i, c;
+
+    for (i = 0; i < n; i++)
+    {
+        for (c = 0; c < channels; c++)
+        {
+            dst[i * channels + c] = flt_to_s16(src[c][i]);
+        }
+    }
+}
+
+static void s16p_to_s16_c(int16_t *dst, const int16_t *const *src, int channels, int n)
+{
+    int i, c;
+
+    for (i = 0; i < n; i++)
+    {
+        for (c = 0; c < channels; c++)
+        {
+            dst[i * channels + c] = src[c][i];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static inline __m128i flt_to_s32_sse2(const float *src)
+{
+    __m128 x = _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(32768.0f));
+
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+    return _mm_cvtps_epi32(x);
+}
+
+__attribute__((target("sse2"))) static void fltp_to_s16_sse2(int16_t *dst, const float *const *src, int channels, int n)
+{
+    int i = 0;
+
+    if (channels == 2)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i l = _mm_packs_epi32(flt_to_s32_sse2(src[0] + i), flt_to_s32_sse2(src[0] + i + 4));
+            __m128i r = _mm_packs_epi32(flt_to_s32_sse2(src[1] + i), flt_to_s32_sse2(src[1] + i + 4));
+
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(l, r));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+        }
+    }
+    else if (channels == 1)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_packs_epi32(flt_to_s32_sse2(src[0] + i), flt_to_s32_sse2(src[0] + i + 4)));
+        }
+    }
+
+    if (i < n)
+    {
+        const float *rest[8];
+        int c;
+
+        for (c = 0; c < channels; c++)
+        {
+            rest[c] = src[c] + i;
+        }
+
+        fltp_to_s16_c(dst + i * channels, rest, channels, n - i);
+    }
+}
+
+__attribute__((target("sse2"))) static void s16p_to_s16_sse2(int16_t *dst, const int16_t *const *src, int channels, int n)
+{
+    int i = 0;
+
+    if (channels == 2)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i l = _mm_loadu_si128((const __m128i *)(src[0] + i));
+            __m128i r = _mm_loadu_si128((const __m128i *)(src[1] + i));
+
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(l, r));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+        }
+    }
+
+    if (i < n)
+    {
+        const int16_t *rest[8];
+        int c;
+
+        for (c = 0; c < channels; c++)
+        {
+            rest[c] = src[c] + i;
+        }
+
+        s16p_to_s16_c(dst + i * channels, rest, channels, n - i);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i flt_to_s16_avx2(const float *src)
+{
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+    __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src), scale), lo), hi);
+    __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + 8), scale), lo), hi);
+
+    /* packs works per 128-bit lane, put the quadwords back in order */
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b)), 0xd8);
+}
+
+/* interleave 16 left and 16 right samples */
+__attribute__((target("avx2"))) static inline void interleave_s16_avx2(int16_t *dst, __m256i l, __m256i r)
+{
+    __m256i lo = _mm256_unpacklo_epi16(l, r); /* samples 0-3, 8-11 */
+    __m256i hi = _mm256_unpackhi_epi16(l, r); /* samples 4-7, 12-15 */
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2"))) static void fltp_to_s16_avx2(int16_t *dst, const float *const *src, int channels, int n)
+{
+    const float *rest[8];
+    int i = 0, c;
+
+    if (channels == 2)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            interleave_s16_avx2(dst + 2 * i, flt_to_s16_avx2(src[0] + i), flt_to_s16_avx2(src[1] + i));
+        }
+    }
+    else if (channels == 1)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + i), flt_to_s16_avx2(src[0] + i));
+        }
+    }
+
+    for (c = 0; c < channels; c++)
+    {
+        rest[c] = src[c] + i;
+    }
+
+    fltp_to_s16_sse2(dst + i * channels, rest, channels, n - i);
+}
+
+__attribute__((target("avx2"))) static void s16p_to_s16_avx2(int16_t *dst, const int16_t *const *src, int channels, int n)
+{
+    const int16_t *rest[8];
+    int i = 0, c;
+
+    if (channels == 2)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            interleave_s16_avx2(dst + 2 * i,
+                                _mm256_loadu_si256((const __m256i *)(src[0] + i)),
+                                _mm256_loadu_si256((const __m256i *)(src[1] + i)));
+        }
+    }
+
+    for (c = 0; c < channels; c++)
+    {
+        rest[c] = src[c] + i;
+    }
+
+    s16p_to_s16_sse2(dst + i * channels, rest, channels, n - i);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#ifdef __aarch64__
+/* vcvtnq rounds to nearest and saturates, vqmovn saturates again to 16
+   bits; 32-bit ARM has no rounding convert and keeps the C version */
+static inline int16x8_t flt_to_s16_neon(const float *src)
+{
+    const float32x4_t scale = vdupq_n_f32(32768.0f);
+
+    return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vmulq_f32(vld1q_f32(src), scale))),
+                        vqmovn_s32(vcvtnq_s32_f32(vmulq_f32(vld1q_f32(src + 4), scale))));
+}
+
+static void fltp_to_s16_neon(int16_t *dst, const float *const *src, int channels, int n)
+{
+    const float *rest[8];
+    int i = 0, c;
+
+    if (channels == 2)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            int16x8x2_t lr = {{flt_to_s16_neon(src[0] + i), flt_to_s16_neon(src[1] + i)}};
+
+            vst2q_s16(dst + 2 * i, lr);
+        }
+    }
+    else if (channels == 1)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            vst1q_s16(dst + i, flt_to_s16_neon(src[0] + i));
+        }
+    }
+
+    for (c = 0; c < channels; c++)
+    {
+        rest[c] = src[c] + i;
+    }
+
+    fltp_to_s16_c(dst + i * channels, rest, channels, n - i);
+}
+#else
+#define fltp_to_s16_neon fltp_to_s16_c
+#endif
+
+static void s16p_to_s16_neon(int16_t *dst, const int16_t *const *src, int channels, int n)
+{
+    const int16_t *rest[8];
+    int i = 0, c;
+
+    if (channels == 2)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            int16x8x2_t lr = {{vld1q_s16(src[0] + i), vld1q_s16(src[1] + i)}};
+
+            vst2q_s16(dst + 2 * i, lr);
+        }
+    }
+
+    for (c = 0; c < channels; c++)
+    {
+        rest[c] = src[c] + i;
+    }
+
+    s16p_to_s16_c(dst + i * channels, rest, channels, n - i);
+}
+#endif
+
+static SampleKernels sample_kernels = {"c", fltp_to_s16_c, s16p_to_s16_c};
+
+static void sample_convert_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    int flags = av_get_cpu_flags();
+
+    if (flags & AV_CPU_FLAG_AVX2)
+    {
+        sample_kernels = (SampleKernels){"avx2", fltp_to_s16_avx2, s16p_to_s16_avx2};
+    }
+    else if (flags & AV_CPU_FLAG_SSE2)
+    {
+        sample_kernels = (SampleKernels){"sse2", fltp_to_s16_sse2, s16p_to_s16_sse2};
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_NEON)
+    {
+        sample_kernels = (SampleKernels){"neon", fltp_to_s16_neon, s16p_to_s16_neon};
+    }
+#endif
+}
+
+/* Converting a large frame in one sws_scale call is a long serial stall
+   on the video thread. The pool cuts the picture into horizontal bands
+   and converts them concurrently, one SwsContext per band since a
+   context only accepts slices in order. The calling thread does band 0
+   itself, so a one-band pool is a plain sws_scale call. */
+static int scale_worker_thread(void *arg);
+
+static void scale_band(ScalePool *pool, ScaleWorker *w)
+{
+    const uint8_t *src[4] = {NULL};
+    uint8_t *dst[4] = {NULL};
+    int i;
+
+    for (i = 0; i < 4 && pool->src[i]; i++)
+    {
+        int y = (i == 1 || i == 2) ? w->src_y >> pool->src_log2_chroma_h : w->src_y;
+        src[i] = pool->src[i] + y * pool->src_linesize[i];
+    }
+
+    dst[0] = pool->dst[0] + w->dst_y * pool->dst_linesize[0];
+    dst[1] = pool->dst[1] + w->dst_y / 2 * pool->dst_linesize[1];
+    dst[2] = pool->dst[2] + w->dst_y / 2 * pool->dst_linesize[2];
+
+    sws_scale(w->sws, src, pool->src_linesize, 0, w->src_h, dst, pool->dst_linesize);
+}
+
+static int scale_worker_thread(void *arg)
+{
+    ScaleWorker *w = (ScaleWorker *)arg;
+
+    for (;;)
+    {
+        SDL_SemWait(w->start);
+
+        if (w->pool->quit)
+        {
+            break;
+        }
+
+        scale_band(w->pool, w);
+        SDL_SemPost(w->pool->done);
+    }
+
+    return 0;
+}
+
+static void scale_pool_free(ScalePool *pool)
+{
+    int i;
+
+    pool->quit = 1;
+
+    for (i = 0; i < pool->nb_workers; i++)
+    {
+        ScaleWorker *w = &pool->workers[i];
+
+        if (w->tid)
+        {
+            SDL_SemPost(w->start);
+            SDL_WaitThread(w->tid, NULL);
+            SDL_DestroySemaphore(w->start);
+        }
+
+        sws_freeContext(w->sws);
+    }
+
+    if (pool->done)
+    {
+        SDL_DestroySemaphore(pool->done);
+    }
+
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* Set up nb_workers bands converting src_w x src_h of src_fmt into a
+   dst_w x dst_h YUV420P picture. 0 workers picks one per ~270 source
+   rows, up to the number of cores. */
+static int scale_pool_init(ScalePool *pool, int nb_workers,
+                           int src_w, int src_h, enum AVPixelFormat src_fmt,
+                           int dst_w, int dst_h)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src_fmt);
+    int align, i;
+
+    memset(pool, 0, sizeof(*pool));
+
+    if (!desc)
+    {
+        return -1;
+    }
+
+    /* bands start on a chroma row of both pictures */
+    align = FFMAX(1 << desc->log2_chroma_h, 2);
+
+    if (nb_workers <= 0)
+    {
+        nb_workers = FFMIN(instance_cores(), src_h / 270);
+    }
+
+    nb_workers = FFMIN(nb_workers, SCALE_THREADS_MAX);
+    nb_workers = FFMIN(nb_workers, FFMIN(src_h, dst_h) / align);
+
+    /* palette planes are not rows, don't cut them */
+    if (nb_workers < 1 || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL)))
+    {
+        nb_workers = 1;
+    }
+
+    pool->nb_workers = nb_workers;
+    pool->src_log2_chroma_h = desc->log2_chroma_h;
+    pool->src_w = src_w;
+    pool->src_h = src_h;
+    pool->src_fmt = src_fmt;
+    pool->dst_w = dst_w;
+    pool->dst_h = dst_h;
+
+    for (i = 0; i < nb_workers; i++)
+    {
+        ScaleWorker *w = &pool->workers[i];
+        int dst_end = (int)((int64_t)dst_h * (i + 1) / nb_workers) & ~(align - 1);
+
+        w->pool = pool;
+        w->dst_y = i ? pool->workers[i - 1].dst_y + pool->workers[i - 1].dst_h : 0;
+        w->dst_h = (i == nb_workers - 1 ? dst_h : dst_end) - w->dst_y;
+        w->src_y = (int)((int64_t)w->dst_y * src_h / dst_h) & ~(align - 1);
+        w->src_h = (i == nb_workers - 1 ? src_h : (int)((int64_t)(w->dst_y + w->dst_h) * src_h / dst_h) & ~(align - 1)) - w->src_y;
+
+        w->sws = sws_getContext(src_w, w->src_h, src_fmt,
+                                dst_w, w->dst_h, AV_PIX_FMT_YUV420P,
+                                SWS_BILINEAR, NULL, NULL, NULL);
+
+        if (!w->sws)
+        {
+            scale_pool_free(pool);
+            return -1;
+        }
+
+        if (i > 0)
+        {
+            w->start = SDL_CreateSemaphore(0);
+            w->tid = create_thread(scale_worker_thread, w);
+        }
+    }
+
+    pool->done = SDL_CreateSemaphore(0);
+    return 0;
+}
+
+/* make sure the pool converts frame into a dst_w x dst_h picture */
+static int scale_pool_update(ScalePool *pool, int nb_workers, AVFrame *frame, int dst_w, int dst_h)
+{
+    if (pool->nb_workers &&
+        pool->src_w == frame->width && pool->src_h == frame->height &&
+        pool->src_fmt == frame->format &&
+        pool->dst_w == dst_w && pool->dst_h == dst_h)
+    {
+        return 0;
+    }
+
+    if (pool->nb_workers)
+    {
+        scale_pool_free(pool);
+    }
+
+    return scale_pool_init(pool, nb_workers, frame->width, frame->height, frame->format, dst_w, dst_h);
+}
+
+/* convert src into the YUV420P planes dst (U in dst[1], V in dst[2]) */
+static void scale_pool_run(ScalePool *pool, uint8_t *const src[4], const int src_linesize[4],
+                           uint8_t *const dst[3], const int dst_linesize[3])
+{
+    int i;
+
+    memcpy(pool->src, src, sizeof(pool->src));
+    memcpy(pool->src_linesize, src_linesize, sizeof(pool->src_linesize));
+    memcpy(pool->dst, dst, sizeof(pool->dst));
+    memcpy(pool->dst_linesize, dst_linesize, sizeof(pool->dst_linesize));
+
+    for (i = 1; i < pool->nb_workers; i++)
+    {
+        SDL_SemPost(pool->workers[i].start);
+    }
+
+    scale_band(pool, &pool->workers[0]);
+
+    for (i = 1; i < pool->nb_workers; i++)
+    {
+        SDL_SemWait(pool->done);
+    }
+}
+
+#ifdef USE_SDL2
+/* A decoded picture at the texture's size in a layout repack_picture
+   knows needs no conversion on the video thread: queue_picture keeps a
+   reference to the decoder's buffer and the main thread copies it into
+   the texture when it is shown. SDL 1.2 overlays are always filled on
+   the video thread, a plain plane copy for YUV420P, so that the
+   presentation thread only has to display them. */
+static int frame_fits_overlay(AVFrame *frame, VideoPicture *vp)
+{
+    return (frame->format == AV_PIX_FMT_YUV420P ||
+            frame->format == AV_PIX_FMT_NV12 ||
+            frame->format == AV_PIX_FMT_YUVJ420P) &&
+           frame->width == vp->width &&
+           frame->height == vp->height;
+}
+
+/* Update the texture of vp from what queue_picture left: a YUV420P
+   frame or vp->pict go in with SDL_UpdateYUVTexture, with no copy of
+   our own, other referenced frames are repacked into the locked
+   texture. Main thread only. */
+static void upload_picture(VideoState *is, VideoPicture *vp)
+{
+    AVFrame *frame = vp->frame;
+    int64_t t = av_gettime_relative();
+
+    uint8_t *dst[3];
+    int dst_linesize[3];
+    void *pixels;
+    int pitch;
+
+    if (!frame || !frame->data[0])
+    {
+        SDL_UpdateYUVTexture(vp->bmp, NULL,
+                             vp->pict.data[0], vp->pict.linesize[0],
+                             vp->pict.data[1], vp->pict.linesize[1],
+                             vp->pict.data[2], vp->pict.linesize[2]);
+    }
+    else if (frame->format == AV_PIX_FMT_YUV420P)
+    {
+        SDL_UpdateYUVTexture(vp->bmp, NULL,
+                             frame->data[0], frame->linesize[0],
+                             frame->data[1], frame->linesize[1],
+                             frame->data[2], frame->linesize[2]);
+    }
+    else if (SDL_LockTexture(vp->bmp, NULL, &pixels, &pitch) == 0)
+    {
+        /* IYUV: Y, then U and V at half the pitch and height */
+        dst[0] = pixels;
+        dst[1] = dst[0] + pitch * vp->height;
+        dst[2] = dst[1] + pitch / 2 * ((vp->height + 1) / 2);
+        dst_linesize[0] = pitch;
+        dst_linesize[1] = pitch / 2;
+        dst_linesize[2] = pitch / 2;
+
+        repack_picture(frame, dst, dst_linesize, vp->width, vp->height);
+
+        SDL_UnlockTexture(vp->bmp);
+    }
+
+    histogram_add(&is->stage_hist[STAGE_UPLOAD], av_gettime_relative() - t);
+}
+#endif
+
+/* size of the window's drawing area */
+static void screen_size(int *w, int *h)
+{
+    SDL_LockMutex(screen_mutex);
+#ifdef USE_SDL2
+    *w = screen_w;
+    *h = screen_h;
+#else
+    *w = screen->w;
+    *h = screen->h;
+#endif
+    SDL_UnlockMutex(screen_mutex);
+}
+
+/* where the picture goes on the screen: as large as fits, keeping the
+   aspect ratio, centered */
+static void display_rect(VideoState *is, SDL_Rect *rect)
+{
+    float aspect_ratio;
+    int w, h, x, y;
+    int screen_w, screen_h;
+    int region_x = 0, region_y = 0;
+
+    screen_size(&screen_w, &screen_h);
+
+    /* a -mosaic tile only has its cell of the window */
+    if (is->tile >= 0)
+    {
+        screen_w /= mosaic_cols;
+        screen_h /= mosaic_rows;
+        region_x = is->tile % mosaic_cols * screen_w;
+        region_y = is->tile / mosaic_cols * screen_h;
+    }
+
+    if (is->video_st->codec->sample_aspect_ratio.num == 0)
+    {
+        aspect_ratio = 0;
+    }
+    else
+    {
+        aspect_ratio = av_q2d(is->video_st->codec->sample_aspect_ratio) *
+                       is->video_st->codec->width / is->video_st->codec->height;
+    }
+
+    if (aspect_ratio <= 0.0)
+    {
+        aspect_ratio = (float)is->video_st->codec->width /
+                       (float)is->video_st->codec->height;
+    }
+
+    h = screen_h;
+    w = ((int)rint(h * aspect_ratio)) & -3;
+
+    if (w > screen_w)
+    {
+        w = screen_w;
+        h = ((int)rint(w / aspect_ratio)) & -3;
+    }
+
+    x = region_x + (screen_w - w) / 2;
+    y = region_y + (screen_h - h) / 2;
+
+    rect->x = x;
+    rect->y = y;
+    rect->w = w;
+    rect->h = h;
+}
+
+/* Size of the overlay for the current window. There is no point in
+   converting and uploading more pixels than the display rect shows, so
+   a picture that is shrunk on screen is shrunk by sws_scale; one that
+   is blown up is left for SDL to stretch. */
+static void overlay_size(VideoState *is, int *w, int *h)
+{
+    SDL_Rect rect;
+
+    display_rect(is, &rect);
+
+    *w = FFMIN(rect.w, is->video_st->codec->width) & ~1;
+    *h = FFMIN(rect.h, is->video_st->codec->height) & ~1;
+    *w = FFMAX(*w, 2);
+    *h = FFMAX(*h, 2);
+}
+
+#ifdef USE_SDL2
+/* The renderer belongs to the main thread: hand it the picture and wait
+   until it is on screen, so the presentation thread keeps pacing the
+   pictures and, with -vsync, returns at the display's refresh. */
+void video_display(VideoState *is)
+{
+    SDL_Event event;
+
+    SDL_LockMutex(is->pictq_mutex);
+    is->display_pending = 1;
+    event.type = FF_DISPLAY_EVENT;
+    event.user.data1 = is;
+    event.user.code = is->generation;
+    SDL_PushEvent(&event);
+
+    while (is->display_pending && !is->quit)
+    {
+        SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+    }
+
+    SDL_UnlockMutex(is->pictq_mutex);
+}
+
+/* Draw the last picture of every tile and present. The renderer's back
+   buffer is not kept between presents, so it is always all of them. */
+static void render_screen(VideoState **tiles, int nb_tiles)
+{
+    SDL_Rect rect;
+    int i;
+
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+
+    for (i = 0; i < nb_tiles; i++)
+    {
+        if (tiles[i] && tiles[i]->shown)
+        {
+            display_rect(tiles[i], &rect);
+            SDL_RenderCopy(renderer, tiles[i]->shown, NULL, &rect);
+        }
+    }
+
+    SDL_RenderPresent(renderer);
+}
+
+/* something is to be redrawn at the next screen_present */
+static int screen_dirty;
+
+/* FF_DISPLAY_EVENT from the presentation thread of is: only the upload,
+   the picture is drawn by the next screen_present along with those of
+   the other tiles */
+static void display_event(VideoState *is)
+{
+    VideoPicture *vp = &is->pictq[is->pictq_rindex];
+
+    if (vp->bmp)
+    {
+        upload_picture(is, vp);
+        is->shown = vp->bmp;
+    }
+
+    is->display_uploaded = 1;
+    screen_dirty = 1;
+}
+
+/* Called by the main loop after every event. Once there are no more
+   events waiting, redraw and present whatever changed in one go, so a
+   -mosaic costs one present, and with -vsync one refresh, per round of
+   pictures rather than one per tile. Then let the presentation threads
+   of the tiles shown go on. */
+static void screen_present(VideoState **tiles, int nb_tiles)
+{
+    int64_t t;
+    int i;
+
+    if (!screen_dirty || SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT))
+    {
+        return;
+    }
+
+    t = av_gettime_relative();
+    render_screen(tiles, nb_tiles);
+    t = av_gettime_relative() - t;
+    screen_dirty = 0;
+
+    for (i = 0; i < nb_tiles; i++)
+    {
+        if (tiles[i] && tiles[i]->display_uploaded)
+        {
+            histogram_add(&tiles[i]->stage_hist[STAGE_DISPLAY], t);
+            tiles[i]->display_uploaded = 0;
+
+            SDL_LockMutex(tiles[i]->pictq_mutex);
+            tiles[i]->display_pending = 0;
+            SDL_CondBroadcast(tiles[i]->pictq_cond);
+            SDL_UnlockMutex(tiles[i]->pictq_mutex);
+        }
+    }
+}
+#else
+void video_display(VideoState *is)
+{
+
+    SDL_Rect rect;
+    VideoPicture *vp;
+    //AVPicture pict;
+    int64_t t;
+    //int i;
+
+    vp = &is->pictq[is->pictq_rindex];
+
+    if (vp->bmp)
+    {
+        display_rect(is, &rect);
+
+        SDL_LockMutex(screen_mutex);
+        t = av_gettime_relative();
+        SDL_DisplayYUVOverlay(vp->bmp, &rect);
+        histogram_add(&is->stage_hist[STAGE_DISPLAY], av_gettime_relative() - t);
+        SDL_UnlockMutex(screen_mutex);
+    }
+}
+#endif
+
+/* release the picture at pictq_rindex back to the video thread */
+static void pictq_next_picture(VideoState *is)
+{
+#ifdef USE_SDL2
+    VideoPicture *vp = &is->pictq[is->pictq_rindex];
+
+    if (vp->frame)
+    {
+        av_frame_unref(vp->frame);
+    }
+#endif
+
+    if (++is->pictq_rindex == is->pictq_max)
+    {
+        is->pictq_rindex = 0;
+    }
+
+    SDL_LockMutex(is->pictq_mutex);
+    is->pictq_size--;
+    SDL_CondSignal(is->pictq_cond);
+    SDL_UnlockMutex(is->pictq_mutex);
+}
+
+/* Show the picture at the head of pictq and return the monotonic_time()
+   at which the next one is due. Only called with a non-empty pictq. */
+static int64_t video_refresh(VideoState *is)
+{
+    VideoPicture *vp;
+    double actual_delay, delay, sync_threshold, ref_clock, diff;
+    int late;
+
+retry:
+    gauge_update(&is->gauges[GAUGE_PICTQ_PICTURES], is->pictq_size);
+    vp = &is->pictq[is->pictq_rindex];
+
+    if (vp->serial != atomic_load(&is->video_serial))
+    {
+        /* queued before a seek */
+        pictq_next_picture(is);
+
+        if (is->pictq_size == 0)
+        {
+            return monotonic_time();
+        }
+
+        goto retry;
+    }
+
+    if (vp->serial != is->frame_serial)
+    {
+        /* first picture after a seek: show it now and time the rest from it */
+        is->frame_serial = vp->serial;
+        is->frame_timer = monotonic_time() / 1000000.0 - is->frame_last_delay;
+        is->frame_last_pts = vp->pts;
+        histogram_add(&is->seek_latency, av_gettime_relative() - is->seek_start);
+    }
+
+    is->video_current_pts = vp->pts;
+    is->video_current_pts_time = av_gettime();
+
+    delay = vp->pts - is->frame_last_pts; /* the pts from last time */
+
+    if (delay <= 0 || delay >= 1.0)
+    {
+        /* if incorrect delay, use previous one */
+        delay = is->frame_last_delay;
+    }
+
+    /* save for next time */
+    is->frame_last_delay = delay;
+    is->frame_last_pts = vp->pts;
+
+    /* Skip or repeat the frame. Take delay into account
+       FFPlay still doesn't "know if this is the best guess." */
+    sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
+    late = 0;
+
+    /* update delay to sync to audio if not master source */
+    if (is->av_sync_type != AV_SYNC_VIDEO_MASTER)
+    {
+        ref_clock = get_master_clock(is);
+        diff = vp->pts - ref_clock;
+
+        if (fabs(diff) < AV_NOSYNC_THRESHOLD)
+        {
+            if (diff <= -sync_threshold)
+            {
+                delay = 0;
+                late = 1;
+            }
+            else if (diff >= sync_threshold)
+            {
+                delay = 2 * delay;
+            }
+        }
+    }
+
+    is->frame_timer += delay;
+    /* computer the REAL delay */
+    actual_delay = is->frame_timer - (monotonic_time() / 1000000.0);
+
+    if (is->av_sync_type == AV_SYNC_VIDEO_MASTER && actual_delay <= -sync_threshold)
+    {
+        late = 1;
+    }
+
+    if (late)
+    {
+        is->late_streak++;
+
+        /* The picture is already behind the clock. If a newer one
+           is waiting, throw this one away rather than show it late. */
+        if (is->pictq_size > 1)
+        {
+            is->frame_drops[FRAME_DROP_DISPLAY]++;
+            pictq_next_picture(is);
+            goto retry;
+        }
+    }
+    else
+    {
+        is->late_streak = 0;
+    }
+
+    /* how far the picture is from the sound being heard with it */
+    if (is->audio_st && !headless)
+    {
+        double offset = vp->pts - get_audio_clock(is);
+
+        if (fabs(offset) < AV_NOSYNC_THRESHOLD)
+        {
+            histogram_add(&is->av_offset, (int64_t)(fabs(offset) * 1000000.0));
+            is->av_offset_last = offset;
+            is->av_offset_sum += offset;
+            is->av_offset_count++;
+        }
+    }
+
+    /* show the picture! */
+    video_display(is);
+    note_first_frame(is);
+
+    /* update queue for next picture! */
+    pictq_next_picture(is);
+
+    if (actual_delay < 0.010)
+    {
+        /* nothing newer to skip to, give the next one a moment */
+        return monotonic_time() + 10000;
+    }
+
+    return (int64_t)(is->frame_timer * 1000000.0);
+}
+
+/* Presents pictures at their deadlines. Sleeping on absolute monotonic
+   deadlines keeps rounding and wake-up errors from accumulating from one
+   frame to the next, and does not depend on the event loop. */
+static int presentation_thread(void *arg)
+{
+    VideoState *is = (VideoState *)arg;
+    int64_t deadline = monotonic_time() + 40000;
+
+    while (!is->quit)
+    {
+        sleep_until(deadline);
+        histogram_add(&is->present_wakeup_error, monotonic_time() - deadline);
+
+        if (!is->video_st)
+        {
+            deadline += 100000;
+            continue;
+        }
+
+        SDL_LockMutex(is->pictq_mutex);
+
+        while (is->pictq_size == 0 && !is->quit)
+        {
+            /* read under pictq_mutex, so the last picture is not still
+               on its way into pictq */
+            int eos = atomic_load(&is->video_eos);
+
+            if (eos >= 0 && atomic_load(&is->video_finished) != eos)
+            {
+                stream_finished(is, &is->video_finished, eos);
+            }
+
+            /* queue_picture signals as soon as a picture arrives */
+            SDL_CondWaitTimeout(is->pictq_cond, is->pictq_mutex, 100);
+        }
+
+        SDL_UnlockMutex(is->pictq_mutex);
+
+        if (is->quit)
+        {
+            break;
+        }
+
+        deadline = video_refresh(is);
+    }
+
+    return 0;
+}
+
+void alloc_picture(void *userdata)
+{
+
+    VideoState *is = (VideoState *)userdata;
+    VideoPicture *vp;
+
+    vp = &is->pictq[is->pictq_windex];
+
+    SDL_LockMutex(screen_mutex);
+
+#ifdef USE_SDL2
+    if (vp->bmp)
+    {
+        if (is->shown == vp->bmp)
+        {
+            is->shown = NULL;
+        }
+
+        SDL_DestroyTexture(vp->bmp);
+    }
+
+    /* queue_picture allocates it again at the new size if it needs it */
+    av_freep(&vp->pict.data[0]);
+
+    vp->bmp = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING,
+                                is->overlay_w, is->overlay_h);
+
+    if (!vp->bmp)
+    {
+        fprintf(stderr, "SDL_CreateTexture: %s\n", SDL_GetError());
+    }
+#else
+    if (vp->bmp)
+    {
+        // we already have one make another, bigger/smaller
+        SDL_FreeYUVOverlay(vp->bmp);
+    }
+
+    // Allocate a place to put our YUV image on that screen
+    vp->bmp = SDL_CreateYUVOverlay(is->overlay_w,
+                                   is->overlay_h,
+                                   SDL_YV12_OVERLAY,
+                                   screen);
+#endif
+    SDL_UnlockMutex(screen_mutex);
+    vp->width = is->overlay_w;
+    vp->height = is->overlay_h;
+
+    /* the presentation thread may be waiting on the same cond */
+    SDL_LockMutex(is->pictq_mutex);
+    vp->allocated = 1;
+    SDL_CondBroadcast(is->pictq_cond);
+    SDL_UnlockMutex(is->pictq_mutex);
+}
+
+int queue_picture(VideoState *is, AVFrame *pFrame, double pts)
+{
+
+    VideoPicture *vp;
+    AVPicture pict;
+    int64_t t;
+
+    /* wait until we have space for a new pic */
+    SDL_LockMutex(is->pictq_mutex);
+
+    while (is->pictq_size >= is->pictq_max &&
+           !is->quit)
+    {
+        SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+    }
+
+    SDL_UnlockMutex(is->pictq_mutex);
+
+    if (is->quit)
+    {
+        return -1;
+    }
+
+    // windex is set to 0 initially
+    vp = &is->pictq[is->pictq_windex];
+
+    /* allocate or resize the buffer! */
+    overlay_size(is, &is->overlay_w, &is->overlay_h);
+
+    if (!vp->bmp ||
+        vp->width != is->overlay_w ||
+        vp->height != is->overlay_h)
+    {
+        SDL_Event event;
+
+        vp->allocated = 0;
+        /* we have to do it in the main thread */
+        event.type = FF_ALLOC_EVENT;
+        event.user.data1 = is;
+        event.user.code = is->generation;
+        SDL_PushEvent(&event);
+
+        /* wait until we have a picture allocated */
+        SDL_LockMutex(is->pictq_mutex);
+
+        while (!vp->allocated && !is->quit)
+        {
+            SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+        }
+
+        SDL_UnlockMutex(is->pictq_mutex);
+
+        if (is->quit)
+        {
+            return -1;
+        }
+    }
+
+    /* We have a place to put our picture on the queue */
+    /* If we are skipping a frame, do we set this to null
+       but still return vp->allocated = 1? */
+
+    if (vp->bmp)
+    {
+#ifdef USE_SDL2
+        if (!vp->frame)
+        {
+            vp->frame = av_frame_alloc();
+        }
+
+        if (!vp->frame || !frame_fits_overlay(pFrame, vp) || av_frame_ref(vp->frame, pFrame) < 0)
+#endif
+        {
+#ifdef USE_SDL2
+            /* the texture is the main thread's: convert into vp->pict,
+               upload_picture takes it from there */
+            if (!vp->pict.data[0] &&
+                av_image_alloc(vp->pict.data, vp->pict.linesize,
+                               vp->width, vp->height, AV_PIX_FMT_YUV420P, 16) < 0)
+            {
+                return -1;
+            }
+
+            pict = vp->pict;
+#else
+            SDL_LockYUVOverlay(vp->bmp);
+
+            /* point pict at the queue */
+
+            pict.data[0] = vp->bmp->pixels[0];
+            pict.data[1] = vp->bmp->pixels[2];
+            pict.data[2] = vp->bmp->pixels[1];
+
+            pict.linesize[0] = vp->bmp->pitches[0];
+            pict.linesize[1] = vp->bmp->pitches[2];
+            pict.linesize[2] = vp->bmp->pitches[1];
+#endif
+
+            // Convert the image into YUV format that SDL uses
+            t = av_gettime_relative();
+
+            if (repack_picture(pFrame, pict.data, pict.linesize, vp->width, vp->height) == 0)
+            {
+                histogram_add(&is->stage_hist[STAGE_REPACK], av_gettime_relative() - t);
+            }
+            else if (scale_pool_update(&is->scale_pool, scale_threads, pFrame, vp->width, vp->height) == 0)
+            {
+                scale_pool_run(&is->scale_pool, pFrame->data, pFrame->linesize,
+                               pict.data, pict.linesize);
+                histogram_add(&is->stage_hist[STAGE_SCALE], av_gettime_relative() - t);
+            }
+
+#ifndef USE_SDL2
+            SDL_UnlockYUVOverlay(vp->bmp);
+#endif
+        }
+
+        vp->pts = pts;
+        vp->serial = atomic_load(&is->video_serial);
+
+        /* now we inform our display thread that we have a pic ready */
+        if (++is->pictq_windex == is->pictq_max)
+        {
+            is->pictq_windex = 0;
+        }
+
+        SDL_LockMutex(is->pictq_mutex);
+        is->pictq_size++;
+        SDL_CondBroadcast(is->pictq_cond);
+        SDL_UnlockMutex(is->pictq_mutex);
+    }
+
+    return 0;
+}
+
+/* headless mode: do the same conversion queue_picture would for an
+   overlay, the plane copy of a YUV420P frame included, into a scratch
+   picture that is never shown */
+static void headless_picture(VideoState *is, AVFrame *pFrame)
+{
+    int w = pFrame->width, h = pFrame->height;
+    int64_t t;
+
+    /* the size can change mid-stream */
+    if (is->headless_pict.data[0] && (is->headless_w != w || is->headless_h != h))
+    {
+        av_freep(&is->headless_pict.data[0]);
+    }
+
+    if (!is->headless_pict.data[0])
+    {
+        if (av_image_alloc(is->headless_pict.data, is->headless_pict.linesize,
+                           w, h, AV_PIX_FMT_YUV420P, 16) < 0)
+        {
+            return;
+        }
+
+        is->headless_w = w;
+        is->headless_h = h;
+    }
+
+    t = av_gettime_relative();
+
+    if (repack_picture(pFrame, is->headless_pict.data, is->headless_pict.linesize, w, h) == 0)
+    {
+        histogram_add(&is->stage_hist[STAGE_REPACK], av_gettime_relative() - t);
+        return;
+    }
+
+    if (scale_pool_update(&is->scale_pool, scale_threads, pFrame, w, h) == 0)
+    {
+        scale_pool_run(&is->scale_pool, pFrame->data, pFrame->linesize,
+                       is->headless_pict.data, is->headless_pict.linesize);
+        histogram_add(&is->stage_hist[STAGE_SCALE], av_gettime_relative() - t);
+    }
+}
+
+/* Put one decoded frame into the ring. swr_convert or the sample
+   kernels write straight into the free space at the write position;
+   anything swr cannot fit there stays buffered inside it until the next
+   reserve. A frame already in the device format is copied in once. */
+static void audio_write_frame(VideoState *is, AVFrame *frame, int data_size, double pts)
+{
+    AudioRing *r = &is->audio_ring;
+    int n = is->audio_frame_bytes;
+    int in_count = frame->nb_samples;
+    int written = 0, consumed = 0, done = 0;
+    uint8_t *dst;
+    unsigned int len;
+
+    /* the frame's length at the output rate; headless has no clock to follow */
+    if (!headless)
+    {
+        synchronize_audio(is, (int)av_rescale(frame->nb_samples, is->audio_out_rate,
+                                              is->audio_st->codec->sample_rate));
+    }
+
+    while (!done && (dst = audio_ring_wait(is, r, &len)))
+    {
+        int got;
+
+        if (is->audio_convert == AUDIO_CONVERT_SWR)
+        {
+            int64_t t = av_gettime_relative();
+
+            got = swr_convert(is->pSwrCtx, &dst, len / n,
+                              (const uint8_t **)frame->extended_data, in_count);
+            histogram_add(&is->stage_hist[STAGE_RESAMPLE], av_gettime_relative() - t);
+
+            if (got < 0)
+            {
+                fprintf(stderr, "reSample to another sample format failed!\n");
+                return;
+            }
+
+            /* the input is in swr now, the rest of the calls drain it */
+            in_count = 0;
+            done = got < len / n;
+            got *= n;
+            atomic_fetch_add(&is->audio_bytes_touched, got);
+        }
+        else if (is->audio_convert == AUDIO_CONVERT_COPY)
+        {
+            got = FFMIN(len, data_size - consumed);
+            memcpy(dst, frame->data[0] + consumed, got);
+            consumed += got;
+            done = consumed == data_size;
+            atomic_fetch_add(&is->audio_bytes_touched, 2 * got);
+        }
+        else
+        {
+            /* consumed counts samples here */
+            int channels = is->audio_out_channels;
+            const uint8_t *src[AUDIO_KERNEL_CHANNELS_MAX];
+            int c, bps = is->audio_convert == AUDIO_CONVERT_FLTP ? 4 : 2;
+            int64_t t = av_gettime_relative();
+
+            got = FFMIN(len / n, frame->nb_samples - consumed);
+
+            for (c = 0; c < channels; c++)
+            {
+                src[c] = frame->extended_data[c] + consumed * bps;
+            }
+
+            if (is->audio_convert == AUDIO_CONVERT_FLTP)
+            {
+                sample_kernels.fltp_to_s16((int16_t *)dst, (const float *const *)src, channels, got);
+            }
+            else
+            {
+                sample_kernels.s16p_to_s16((int16_t *)dst, (const int16_t *const *)src, channels, got);
+            }
+
+            histogram_add(&is->stage_hist[STAGE_RESAMPLE], av_gettime_relative() - t);
+            consumed += got;
+            done = consumed == frame->nb_samples;
+            got *= n;
+            atomic_fetch_add(&is->audio_bytes_touched, got);
+        }
+
+        audio_ring_commit(r, got);
+        written += got;
+        is->audio_ring_clock = pts + (double)written / (is->audio_out_rate * n);
+    }
+
+    /* the end of the frame, less what swr is still holding on to */
+    is->audio_ring_clock = pts + (double)frame->nb_samples / is->audio_st->codec->sample_rate;
+
+    if (is->audio_convert == AUDIO_CONVERT_SWR)
+    {
+        is->audio_ring_clock -= (double)swr_get_delay(is->pSwrCtx, is->audio_out_rate) / is->audio_out_rate;
+    }
+}
+
+/* at the end of the stream, write out what swr still holds */
+static void audio_flush_resampler(VideoState *is)
+{
+    AudioRing *r = &is->audio_ring;
+    uint8_t *dst;
+    unsigned int len;
+    int got;
+
+    if (is->audio_convert != AUDIO_CONVERT_SWR)
+    {
+        return;
+    }
+
+    while ((dst = audio_ring_wait(is, r, &len)) &&
+           (got = swr_convert(is->pSwrCtx, &dst, len / is->audio_frame_bytes, NULL, 0)) > 0)
+    {
+        got *= is->audio_frame_bytes;
+        atomic_fetch_add(&is->audio_bytes_touched, got);
+        audio_ring_commit(r, got);
+    }
+}
+
+/* Pass on what audio_callback noticed and could not act on itself:
+   the first sample of an item without video played, and the last. */
+static void audio_notify(VideoState *is)
+{
+    int played_out = atomic_load(&is->audio_played_out);
+
+    if (!is->video_st && !is->first_frame_sent && !headless &&
+        atomic_load(&is->first_frame_time))
+    {
+        SDL_Event event;
+
+        is->first_frame_sent = 1;
+        event.type = FF_FIRST_FRAME_EVENT;
+        event.user.data1 = is;
+        event.user.code = is->generation;
+        SDL_PushEvent(&event);
+    }
+
+    if (played_out != atomic_load(&is->audio_finished))
+    {
+        stream_finished(is, &is->audio_finished, played_out);
+    }
+}
+
+/* At the end of the stream: wait for the callback to play the last
+   sample, or for a seek to bring new packets. */
+static void audio_wait_played_out(VideoState *is)
+{
+    while (!is->quit &&
+           atomic_load(&is->audio_played_out) != atomic_load(&is->audio_eos) &&
+           !packet_queue_nb_packets(&is->audioq))
+    {
+        audio_notify(is);
+        SDL_SemWaitTimeout(is->audio_ring.space, 100);
+    }
+
+    audio_notify(is);
+}
+
+/* Decodes and resamples ahead of the sound card into audio_ring, so
+   audio_callback only has to copy. In headless mode there is no card:
+   the samples are decoded and converted as fast as the packets arrive,
+   and audio_ring_wait drops them again. */
+static int audio_thread(void *arg)
+{
+    VideoState *is = (VideoState *)arg;
+    double pts;
+    int data_size;
+
+    while ((data_size = audio_decode_frame(is, &pts)) != -1)
+    {
+        if (data_size == AVERROR_EOF)
+        {
+            audio_flush_resampler(is);
+
+            if (headless)
+            {
+                stream_finished(is, &is->audio_finished, is->audio_serial);
+            }
+            else
+            {
+                atomic_store(&is->audio_eos, is->audio_serial);
+                atomic_store(&is->audio_ring.eof, 1);
+                audio_wait_played_out(is);
+            }
+
+            continue;
+        }
+
+        /* decoding forward from the keyframe before a seek target */
+        if (pts + (double)is->audio_frame.nb_samples / is->audio_st->codec->sample_rate <
+            is->audio_skip_until)
+        {
+            continue;
+        }
+
+        audio_write_frame(is, &is->audio_frame, data_size, pts);
+        audio_notify(is);
+        gauge_update(&is->gauges[GAUGE_AUDIO_RING_BYTES], audio_ring_fill(&is->audio_ring));
+    }
+
+    atomic_store(&is->audio_ring.eof, 1);
+    return 0;
+}
+
+double synchronize_video(VideoState *is, AVFrame *src_frame, double pts)
+{
+
+    double frame_delay;
+
+    if (pts != 0)
+    {
+        /* if we have pts, set video clock to it */
+        is->video_clock = pts;
+    }
+    else
+    {
+        /* if we aren't given a pts, set it to the clock */
+        pts = is->video_clock;
+    }
+
+    /* update the video clock */
+    frame_delay = av_q2d(is->video_st->codec->time_base);
+    /* if we are repeating a frame, adjust clock accordingly */
+    frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
+    is->video_clock += frame_delay;
+    return pts;
+}
+
+/* A freshly decoded picture that is already behind the master clock is
+   not worth queueing, as long as there is more video to decode. */
+static int video_frame_is_late(VideoState *is, double pts)
+{
+    double diff;
+
+    if (is->av_sync_type == AV_SYNC_VIDEO_MASTER ||
+        packet_queue_nb_packets(&is->videoq) == 0)
+    {
+        return 0;
+    }
+
+    diff = pts - get_master_clock(is);
+
+    return fabs(diff) < AV_NOSYNC_THRESHOLD &&
+           diff < -(is->frame_last_delay + AV_SYNC_THRESHOLD);
+}
+
+int video_thread(void *arg)
+{
+    VideoState *is = (VideoState *)arg;
+    AVPacket pkt1, *packet = &pkt1;
+    int frameFinished;
+    AVFrame *pFrame;
+    double pts;
+    int64_t t;
+    int draining = 0;
+
+    pFrame = av_frame_alloc();
+
+    for (;;)
+    {
+        /* while draining, the empty end-of-stream packet is decoded
+           again until the codec has nothing left */
+        if (!draining && packet_queue_get(&is->videoq, packet, 1) < 0)
+        {
+            // means we quit getting packets
+            break;
+        }
+
+        if (packet->data == flush_pkt.data)
+        {
+            /* a seek: decode from the keyframe before seek_target but
+               only queue pictures from seek_target on */
+            avcodec_flush_buffers(is->video_st->codec);
+            is->late_streak = 0;
+            is->video_clock = is->seek_target;
+            is->video_skip_until = is->seek_target - av_q2d(is->video_st->codec->time_base) / 2;
+            atomic_store(&is->video_serial, atomic_load(&is->seek_serial));
+            continue;
+        }
+
+        draining = !packet->data;
+
+        gauge_update(&is->gauges[GAUGE_VIDEOQ_PACKETS], packet_queue_nb_packets(&is->videoq));
+        gauge_update(&is->gauges[GAUGE_VIDEOQ_BYTES], is->videoq.size);
+
+        pts = 0;
+
+        /* While the display keeps finding pictures late, let the decoder
+           skip the frames nothing references so it can catch up. */
+        if (is->late_streak >= LATE_STREAK_SKIP_NONREF)
+        {
+            is->video_st->codec->skip_frame = AVDISCARD_NONREF;
+        }
+        else if (is->late_streak == 0)
+        {
+            is->video_st->codec->skip_frame = AVDISCARD_DEFAULT;
+        }
+
+        /* The codec copies reordered_opaque into the frame decoded from
+           this packet, even when a frame thread finishes it later, so the
+           packet pts follows its own picture. */
+        is->video_st->codec->reordered_opaque = packet->pts;
+        // Decode video frame
+        t = av_gettime_relative();
+        avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished,
+                              packet);
+        histogram_add(&is->stage_hist[STAGE_VIDEO_DECODE], av_gettime_relative() - t);
+
+        if (pFrame->pkt_dts == AV_NOPTS_VALUE && pFrame->reordered_opaque != AV_NOPTS_VALUE)
+        {
+            pts = pFrame->reordered_opaque;
+        }
+        else if (pFrame->pkt_dts != AV_NOPTS_VALUE)
+        {
+            pts = pFrame->pkt_dts;
+        }
+        else
+        {
+            pts = 0;
+        }
+
+        pts *= av_q2d(is->video_st->time_base);
+
+        // Did we get a video frame?
+        if (frameFinished)
+        {
+            is->video_frames++;
+            pts = synchronize_video(is, pFrame, pts);
+
+            if (pts < is->video_skip_until)
+            {
+                is->seek_frames_skipped++;
+            }
+            else if (headless)
+            {
+                headless_picture(is, pFrame);
+                note_first_frame(is);
+            }
+            else if (video_frame_is_late(is, pts))
+            {
+                is->frame_drops[FRAME_DROP_DECODE]++;
+            }
+            else if (queue_picture(is, pFrame, pts) < 0)
+            {
+                break;
+            }
+
+            av_frame_unref(pFrame);
+        }
+        else if (is->video_st->codec->skip_frame == AVDISCARD_NONREF)
+        {
+            /* no picture while skipping: count it as a skipped frame */
+            is->frame_drops[FRAME_DROP_NONREF]++;
+        }
+
+        if (draining)
+        {
+            if (frameFinished)
+            {
+                continue;
+            }
+
+            /* every picture is queued, the presentation thread finishes
+               the stream once it has shown them */
+            draining = 0;
+            atomic_store(&is->video_eos, atomic_load(&is->video_serial));
+
+            if (headless)
+            {
+                stream_finished(is, &is->video_finished, atomic_load(&is->video_serial));
+            }
+        }
+
+        av_packet_unref(packet);
+    }
+
+    av_frame_free(&pFrame);
+
+    return 0;
+}
+
+/* swresample from the decoder's format to the one audio_open_converter
+   picked; also what drift correction switches to */
+static int audio_open_resampler(VideoState *is, AVCodecContext *codecCtx)
+{
+    int64_t in_layout = codecCtx->channel_layout;
+
+    // Some MP3/WAV don't tell the layout, take the usual one for the
+    // channel count
+    if (in_layout == 0 || av_get_channel_layout_nb_channels(in_layout) != codecCtx->channels)
+    {
+        in_layout = av_get_default_channel_layout(codecCtx->channels);
+    }
+
+    is->pSwrCtx = swr_alloc_set_opts(NULL,
+                                     av_get_default_channel_layout(is->audio_out_channels),
+                                     AV_SAMPLE_FMT_S16, is->audio_out_rate,
+                                     in_layout, codecCtx->sample_fmt, codecCtx->sample_rate,
+                                     0, NULL);
+
+    if (!is->pSwrCtx || swr_init(is->pSwrCtx) < 0)
+    {
+        fprintf(stderr, "Cannot resample %d Hz %s %d channels to %d Hz s16 %d channels\n",
+                codecCtx->sample_rate, av_get_sample_fmt_name(codecCtx->sample_fmt),
+                codecCtx->channels, is->audio_out_rate, is->audio_out_channels);
+        swr_free(&is->pSwrCtx);
+        return -1;
+    }
+
+    is->audio_convert = AUDIO_CONVERT_SWR;
+    return 0;
+}
+
+/* Decide how audio_thread turns decoded frames into s16 at the device's
+   rate and channel count. Only a rate or layout change needs
+   swresample; planar float and planar s16 at the device's own rate are
+   interleaved by the sample kernels and packed s16 is copied. */
+static int audio_open_converter(VideoState *is, AVCodecContext *codecCtx, int out_rate, int out_channels)
+{
+    is->audio_out_rate = out_rate;
+    is->audio_out_channels = out_channels;
+    is->audio_frame_bytes = 2 * out_channels;
+
+    if (codecCtx->sample_rate == out_rate && codecCtx->channels == out_channels)
+    {
+        if (codecCtx->sample_fmt == AV_SAMPLE_FMT_S16)
+        {
+            is->audio_convert = AUDIO_CONVERT_COPY;
+            return 0;
+        }
+
+        if (out_channels <= AUDIO_KERNEL_CHANNELS_MAX && codecCtx->sample_fmt == AV_SAMPLE_FMT_FLTP)
+        {
+            is->audio_convert = AUDIO_CONVERT_FLTP;
+            return 0;
+        }
+
+        if (out_channels <= AUDIO_KERNEL_CHANNELS_MAX && codecCtx->sample_fmt == AV_SAMPLE_FMT_S16P)
+        {
+            is->audio_convert = AUDIO_CONVERT_S16P;
+            return 0;
+        }
+    }
+
+    return audio_open_resampler(is, codecCtx);
+}
+
+int stream_component_open(VideoState *is, int stream_index)
+{
+
+    AVFormatContext *pFormatCtx = is->pFormatCtx;
+    AVCodecContext *codecCtx = NULL;
+    AVCodec *codec = NULL;
+    AVDictionary *optionsDict = NULL;
+    SDL_AudioSpec wanted_spec, spec;
+
+    if (stream_index < 0 || stream_index >= pFormatCtx->nb_streams)
+    {
+        return -1;
+    }
+
+    // Get a pointer to the codec context for the video stream
+    codecCtx = pFormatCtx->streams[stream_index]->codec;
+
+    if (codecCtx->codec_type == AVMEDIA_TYPE_AUDIO && !headless)
+    {
+        SDL_LockMutex(audio_device_mutex);
+
+        if (!audio_device_open)
+        {
+            // Set audio settings from codec info
+            wanted_spec.freq = codecCtx->sample_rate;
+            wanted_spec.format = AUDIO_S16SYS;
+            wanted_spec.channels = codecCtx->channels;
+            wanted_spec.silence = 0;
+            wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
+            wanted_spec.callback = audio_callback;
+            wanted_spec.userdata = NULL;
+
+            if (SDL_OpenAudio(&wanted_spec, &audio_device_spec) < 0)
+            {
+                SDL_UnlockMutex(audio_device_mutex);
+                fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+                return -1;
+            }
+
+            audio_device_open = 1;
+
+            if (nb_mosaic && audio_tile < 0)
+            {
+                audio_mix_buf = av_malloc(audio_device_spec.size);
+            }
+        }
+
+        /* later items play at whatever the first one opened */
+        spec = audio_device_spec;
+        SDL_UnlockMutex(audio_device_mutex);
+
+        if (spec.format != AUDIO_S16SYS)
+        {
+            fprintf(stderr, "SDL_OpenAudio: device wants format 0x%x, not s16\n", spec.format);
+            return -1;
+        }
+
+        is->audio_hw_buf_size = spec.size;
+    }
+    else if (codecCtx->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        // Decode on several cores: whole frames in parallel where the
+        // codec allows it, otherwise slices of one frame
+        codecCtx->thread_count = decoder_threads ? decoder_threads : instance_cores();
+        codecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        // Frames stay valid after the next decode call, so pictq can hold
+        // them by reference
+        codecCtx->refcounted_frames = 1;
+    }
+
+    codec = avcodec_find_decoder(codecCtx->codec_id);
+
+    if (!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0))
+    {
+        fprintf(stderr, "Unsupported codec!\n");
+        return -1;
+    }
+
+    switch (codecCtx->codec_type)
+    {
+    case AVMEDIA_TYPE_AUDIO:
+        /* headless mode has no device, pretend it took the source as is */
+        if (audio_open_converter(is, codecCtx,
+                                 headless ? codecCtx->sample_rate : spec.freq,
+                                 headless ? codecCtx->channels : spec.channels) < 0)
+        {
+            return -1;
+        }
+
+        is->audioStream = stream_index;
+        is->audio_st = pFormatCtx->streams[stream_index];
+
+        /* averaging filter for audio sync */
+        is->audio_diff_avg_coef = exp(log(0.01 / AUDIO_DIFF_AVG_NB));
+        is->audio_diff_avg_count = 0;
+        /* Correct audio only if larger error than this */
+        is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / codecCtx->sample_rate;
+
+        memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
+        is->audioq.time_base = is->audio_st->time_base;
+        is->audioq.space = &is->demux_space;
+        break;
+
+    case AVMEDIA_TYPE_VIDEO:
+        is->videoStream = stream_index;
+        is->video_st = pFormatCtx->streams[stream_index];
+
+        is->frame_timer = (double)monotonic_time() / 1000000.0;
+        is->frame_last_delay = 40e-3;
+        is->video_current_pts_time = av_gettime();
+
+        is->videoq.time_base = is->video_st->time_base;
+        is->videoq.space = &is->demux_space;
+
+        /* the conversion is set up by queue_picture from the first frame
+           decoded, whose size and format the probe may not have known */
+        is->video_tid = create_thread(video_thread, is);
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+#ifndef _WIN32
+/* keep the next MAPPED_WILLNEED_WINDOW bytes on their way into memory */
+static void mapped_input_advise(MappedInput *m)
+{
+    static long page;
+    int64_t from, to;
+
+    if (m->pos >= m->advised_from && m->pos + MAPPED_WILLNEED_WINDOW / 2 <= m->advised_to)
+    {
+        return;
+    }
+
+    if (!page)
+    {
+        page = sysconf(_SC_PAGESIZE);
+    }
+
+    from = m->pos & ~(int64_t)(page - 1);
+    to = FFMIN(from + MAPPED_WILLNEED_WINDOW, m->size);
+
+    if (to > from)
+    {
+        madvise(m->data + from, to - from, MADV_WILLNEED);
+    }
+
+    m->advised_from = from;
+    m->advised_to = to;
+}
+
+static int mapped_input_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MappedInput *m = (MappedInput *)opaque;
+    int n = (int)FFMIN(buf_size, m->size - m->pos);
+
+    if (n <= 0)
+    {
+        return AVERROR_EOF;
+    }
+
+    memcpy(buf, m->data + m->pos, n);
+    m->pos += n;
+    mapped_input_advise(m);
+    return n;
+}
+
+static int64_t mapped_input_seek(void *opaque, int64_t offset, int whence)
+{
+    MappedInput *m = (MappedInput *)opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        return m->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = m->pos + offset;
+        break;
+    case SEEK_END:
+        pos = m->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0 || pos > m->size)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    m->pos = pos;
+    mapped_input_advise(m);
+    return pos;
+}
+
+/* Map filename and point is->io_context at it. Returns -1 for anything
+   that is not a regular file, which is then opened the usual way. */
+static int mapped_input_open(VideoState *is, const char *filename)
+{
+    MappedInput *m;
+    struct stat st;
+    uint8_t *buffer;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    /* demuxers mostly read front to back: read ahead aggressively and
+       drop pages behind us early */
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    m = av_mallocz(sizeof(*m));
+    buffer = av_malloc(MAPPED_IO_BUFFER_SIZE);
+
+    if (!m || !buffer)
+    {
+        av_free(m);
+        av_free(buffer);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    m->data = data;
+    m->size = st.st_size;
+    mapped_input_advise(m);
+
+    is->io_context = avio_alloc_context(buffer, MAPPED_IO_BUFFER_SIZE, 0, m,
+                                        mapped_input_read, NULL, mapped_input_seek);
+
+    if (!is->io_context)
+    {
+        av_free(buffer);
+        av_free(m);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    is->mapped = m;
+    return 0;
+}
+#else
+static int mapped_input_open(VideoState *is, const char *filename)
+{
+    return -1;
+}
+#endif
+
+/* Stand-in for slow or high-latency storage: every read of the
+   underlying input first sleeps -slow-io ms. */
+static int slow_input_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    AVIOContext *src = (AVIOContext *)opaque;
+    int n;
+
+    SDL_Delay(slow_io_ms);
+    n = avio_read(src, buf, buf_size);
+    return n == 0 ? AVERROR_EOF : n;
+}
+
+static int64_t slow_input_seek(void *opaque, int64_t offset, int whence)
+{
+    AVIOContext *src = (AVIOContext *)opaque;
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return avio_size(src);
+    }
+
+    return avio_seek(src, offset, whence & ~AVSEEK_FORCE);
+}
+
+static AVIOContext *slow_input_open(AVIOContext *src)
+{
+    uint8_t *buffer = av_malloc(MAPPED_IO_BUFFER_SIZE);
+
+    return buffer ? avio_alloc_context(buffer, MAPPED_IO_BUFFER_SIZE, 0, src,
+                                       slow_input_read, NULL, slow_input_seek)
+                  : NULL;
+}
+
+/* The read-ahead stage. A thread keeps reading the input into a window
+   of -readahead bytes ahead of the demuxer, so a slow read only stalls
+   av_read_frame when the whole window has been used up. The demuxer
+   reads from the window through a custom AVIOContext; seeks that land
+   inside the window just skip forward, any other seek empties it and
+   restarts the thread at the new position. */
+static int readahead_thread(void *arg)
+{
+    ReadAhead *ra = (ReadAhead *)arg;
+
+    SDL_LockMutex(ra->mutex);
+
+    while (!ra->is->quit)
+    {
+        int serial, off, chunk, n;
+
+        if (ra->seek_request)
+        {
+            int64_t target = ra->seek_pos;
+
+            SDL_UnlockMutex(ra->mutex);
+            ra->seek_result = avio_seek(ra->src, target, SEEK_SET);
+            SDL_LockMutex(ra->mutex);
+
+            ra->pos = target;
+            ra->rpos = 0;
+            ra->fill = 0;
+            ra->eof = ra->seek_result < 0;
+            ra->serial++;
+            ra->seek_request = 0;
+            SDL_CondBroadcast(ra->cond);
+            continue;
+        }
+
+        if (ra->eof || ra->fill == ra->size)
+        {
+            SDL_CondWaitTimeout(ra->cond, ra->mutex, 100);
+            continue;
+        }
+
+        /* read into the free space after the data, up to the end of buf */
+        off = (ra->rpos + ra->fill) % ra->size;
+        chunk = FFMIN(ra->size - ra->fill, ra->size - off);
+        chunk = FFMIN(chunk, READAHEAD_CHUNK_SIZE);
+        serial = ra->serial;
+
+        SDL_UnlockMutex(ra->mutex);
+        n = avio_read(ra->src, ra->buf + off, chunk);
+        SDL_LockMutex(ra->mutex);
+
+        /* a seek came in while reading, the data is for the old position */
+        if (serial != ra->serial || ra->seek_request)
+        {
+            continue;
+        }
+
+        if (n > 0)
+        {
+            ra->fill += n;
+        }
+        else
+        {
+            ra->eof = 1;
+        }
+
+        SDL_CondBroadcast(ra->cond);
+    }
+
+    SDL_UnlockMutex(ra->mutex);
+    return 0;
+}
+
+static int readahead_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    ReadAhead *ra = (ReadAhead *)opaque;
+    int64_t stall_start = 0;
+    int n, first;
+
+    SDL_LockMutex(ra->mutex);
+
+    while (ra->fill == 0 && !ra->eof && !ra->is->quit)
+    {
+        if (!stall_start)
+        {
+            stall_start = av_gettime_relative();
+        }
+
+        SDL_CondWaitTimeout(ra->cond, ra->mutex, 100);
+    }
+
+    ra->reads++;
+
+    if (stall_start)
+    {
+        ra->stalled_reads++;
+        histogram_add(&ra->stall, av_gettime_relative() - stall_start);
+    }
+
+    if (ra->fill == 0)
+    {
+        SDL_UnlockMutex(ra->mutex);
+        return AVERROR_EOF;
+    }
+
+    n = FFMIN(buf_size, ra->fill);
+    first = FFMIN(n, ra->size - ra->rpos);
+    memcpy(buf, ra->buf + ra->rpos, first);
+    memcpy(buf + first, ra->buf, n - first);
+
+    ra->rpos = (ra->rpos + n) % ra->size;
+    ra->fill -= n;
+    ra->pos += n;
+    SDL_CondBroadcast(ra->cond);
+    SDL_UnlockMutex(ra->mutex);
+    return n;
+}
+
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence)
+{
+    ReadAhead *ra = (ReadAhead *)opaque;
+    int64_t target;
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return ra->src_size >= 0 ? ra->src_size : AVERROR(ENOSYS);
+    }
+
+    SDL_LockMutex(ra->mutex);
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case SEEK_SET:
+        target = offset;
+        break;
+    case SEEK_CUR:
+        target = ra->pos + offset;
+        break;
+    case SEEK_END:
+        target = ra->src_size + offset;
+        break;
+    default:
+        SDL_UnlockMutex(ra->mutex);
+        return AVERROR(EINVAL);
+    }
+
+    if (target >= ra->pos && target <= ra->pos + ra->fill)
+    {
+        int skip = (int)(target - ra->pos);
+
+        ra->rpos = (ra->rpos + skip) % ra->size;
+        ra->fill -= skip;
+        ra->pos = target;
+        ra->seeks_in_window++;
+        SDL_CondBroadcast(ra->cond);
+    }
+    else
+    {
+        int64_t stall_start = av_gettime_relative();
+
+        ra->seek_pos = target;
+        ra->seek_request = 1;
+        ra->seeks_refill++;
+        SDL_CondBroadcast(ra->cond);
+
+        while (ra->seek_request && !ra->is->quit)
+        {
+            SDL_CondWaitTimeout(ra->cond, ra->mutex, 100);
+        }
+
+        histogram_add(&ra->stall, av_gettime_relative() - stall_start);
+
+        if (ra->seek_result < 0)
+        {
+            SDL_UnlockMutex(ra->mutex);
+            return ra->seek_result;
+        }
+    }
+
+    SDL_UnlockMutex(ra->mutex);
+    return target;
+}
+
+static AVIOContext *readahead_open(VideoState *is, AVIOContext *src, int size)
+{
+    ReadAhead *ra = av_mallocz(sizeof(*ra));
+    uint8_t *buffer = av_malloc(MAPPED_IO_BUFFER_SIZE);
+    AVIOContext *pb;
+
+    if (!ra || !buffer || !(ra->buf = av_malloc(size)))
+    {
+        goto fail;
+    }
+
+    ra->is = is;
+    ra->src = src;
+    ra->src_size = avio_size(src);
+    ra->size = size;
+    ra->mutex = SDL_CreateMutex();
+    ra->cond = SDL_CreateCond();
+
+    pb = avio_alloc_context(buffer, MAPPED_IO_BUFFER_SIZE, 0, ra,
+                            readahead_read, NULL, readahead_seek);
+
+    if (!pb)
+    {
+        goto fail;
+    }
+
+    is->readahead = ra;
+    ra->tid = create_thread(readahead_thread, ra);
+    return pb;
+
+fail:
+    if (ra)
+    {
+        av_free(ra->buf);
+    }
+
+    av_free(ra);
+    av_free(buffer);
+    return NULL;
+}
+
+/* The stream parameters avformat_find_stream_info works out, kept in
+   -probe-cache DIR in one small text file per input. The file name is
+   the input's device, inode, size and mtime, so a file that changes
+   gets a new entry and the old one is simply never read again. */
+#define PROBE_CACHE_VERSION 2
+
+#ifndef _WIN32
+static int probe_cache_path(char *path, int size, const char *filename)
+{
+    struct stat st;
+
+    if (!probe_cache_dir || stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+
+    snprintf(path, size, "%s/%llx-%llx-%llx-%llx.probe", probe_cache_dir,
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+    return 0;
+}
+#else
+static int probe_cache_path(char *path, int size, const char *filename)
+{
+    return -1;
+}
+#endif
+
+/* one stream's line of a probe cache file */
+typedef struct ProbeCacheStream
+{
+    int type, codec_id;
+    AVRational time_base, r_frame_rate, avg_frame_rate;
+    int width, height, pix_fmt, sample_rate, channels, sample_fmt;
+    unsigned long long channel_layout;
+    long long duration, start_time, bit_rate;
+} ProbeCacheStream;
+
+/* Fill in ic's streams from the cache. Only used if the demuxer found
+   the same streams with the same codecs the cached probe did; the whole
+   file is parsed before anything in ic is changed, so a damaged one
+   leaves ic as it was, to be probed again. */
+static int probe_cache_load(AVFormatContext *ic, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    ProbeCacheStream *ps = NULL;
+    int version, nb_streams, i;
+    long long duration, start_time, bit_rate;
+
+    if (!f)
+    {
+        return -1;
+    }
+
+    if (fscanf(f, "videoplayer-probe %d streams %d duration %lld start %lld bitrate %lld\n",
+               &version, &nb_streams, &duration, &start_time, &bit_rate) != 5 ||
+        version != PROBE_CACHE_VERSION || nb_streams != ic->nb_streams ||
+        !(ps = av_mallocz(nb_streams * sizeof(*ps))))
+    {
+        fclose(f);
+        return -1;
+    }
+
+    for (i = 0; i < nb_streams; i++)
+    {
+        ProbeCacheStream *p = &ps[i];
+        AVCodecContext *c = ic->streams[i]->codec;
+
+        if (fscanf(f, "%d %d tb %d/%d size %dx%d pix %d rate %d ch %d layout %llx sfmt %d "
+                      "fps %d/%d avg %d/%d dur %lld start %lld br %lld\n",
+                   &p->type, &p->codec_id, &p->time_base.num, &p->time_base.den,
+                   &p->width, &p->height, &p->pix_fmt, &p->sample_rate, &p->channels,
+                   &p->channel_layout, &p->sample_fmt,
+                   &p->r_frame_rate.num, &p->r_frame_rate.den,
+                   &p->avg_frame_rate.num, &p->avg_frame_rate.den,
+                   &p->duration, &p->start_time, &p->bit_rate) != 18 ||
+            p->type != c->codec_type || p->codec_id != c->codec_id)
+        {
+            av_free(ps);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+
+    for (i = 0; i < nb_streams; i++)
+    {
+        ProbeCacheStream *p = &ps[i];
+        AVStream *st = ic->streams[i];
+        AVCodecContext *c = st->codec;
+
+        c->time_base = p->time_base;
+        c->width = p->width;
+        c->height = p->height;
+        c->pix_fmt = p->pix_fmt;
+        c->sample_rate = p->sample_rate;
+        c->channels = p->channels;
+        c->channel_layout = p->channel_layout;
+        c->sample_fmt = p->sample_fmt;
+        c->bit_rate = p->bit_rate;
+        st->r_frame_rate = p->r_frame_rate;
+        st->avg_frame_rate = p->avg_frame_rate;
+        st->duration = p->duration;
+        st->start_time = p->start_time;
+    }
+
+    ic->duration = duration;
+    ic->start_time = start_time;
+    ic->bit_rate = bit_rate;
+    av_free(ps);
+    return 0;
+}
+
+static void probe_cache_store(AVFormatContext *ic, const char *path)
+{
+    char tmp_path[1100];
+    FILE *f;
+    int i;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    f = fopen(tmp_path, "w");
+
+    if (!f)
+    {
+        fprintf(stderr, "Could not write the probe cache %s\n", tmp_path);
+        return;
+    }
+
+    fprintf(f, "videoplayer-probe %d streams %d duration %lld start %lld bitrate %lld\n",
+            PROBE_CACHE_VERSION, ic->nb_streams, (long long)ic->duration,
+            (long long)ic->start_time, (long long)ic->bit_rate);
+
+    for (i = 0; i < ic->nb_streams; i++)
+    {
+        AVStream *st = ic->streams[i];
+        AVCodecContext *c = st->codec;
+
+        fprintf(f, "%d %d tb %d/%d size %dx%d pix %d rate %d ch %d layout %llx sfmt %d "
+                   "fps %d/%d avg %d/%d dur %lld start %lld br %lld\n",
+                c->codec_type, c->codec_id, c->time_base.num, c->time_base.den,
+                c->width, c->height, c->pix_fmt, c->sample_rate, c->channels,
+                (unsigned long long)c->channel_layout, c->sample_fmt,
+                st->r_frame_rate.num, st->r_frame_rate.den,
+                st->avg_frame_rate.num, st->avg_frame_rate.den,
+                (long long)st->duration, (long long)st->start_time, (long long)c->bit_rate);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Could not write the probe cache %s\n", path);
+        remove(tmp_path);
+    }
+}
+
+/* Does the probe know everything about the streams decode_thread picks,
+   the first video and the first audio one? A -fast probe cut short can
+   leave a pixel or sample format unknown, which is not worth keeping. */
+static int probe_complete(AVFormatContext *ic)
+{
+    int i, video = 0, audio = 0;
+
+    for (i = 0; i < ic->nb_streams; i++)
+    {
+        AVCodecContext *c = ic->streams[i]->codec;
+
+        if (c->codec_type == AVMEDIA_TYPE_VIDEO && !video++ &&
+            (c->pix_fmt == AV_PIX_FMT_NONE || !c->width || !c->height))
+        {
+            return 0;
+        }
+
+        if (c->codec_type == AVMEDIA_TYPE_AUDIO && !audio++ &&
+            (c->sample_fmt == AV_SAMPLE_FMT_NONE || !c->sample_rate || !c->channels))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Everything between avformat_open_input and knowing the streams. With
+   -fast, avformat_open_input was already told to read little. */
+static int probe_streams(VideoState *is, AVFormatContext *ic)
+{
+    char path[1100];
+    /* formats without a header only find their streams while probing */
+    int cached = !(ic->ctx_flags & AVFMTCTX_NOHEADER) &&
+                 probe_cache_path(path, sizeof(path), is->filename) == 0;
+
+    if (cached && probe_cache_load(ic, path) == 0)
+    {
+        is->probe_cache_hit = 1;
+        return 0;
+    }
+
+    if (avformat_find_stream_info(ic, NULL) < 0)
+    {
+        return -1;
+    }
+
+    if (cached && probe_complete(ic))
+    {
+        probe_cache_store(ic, path);
+    }
+
+    return 0;
+}
+
+int decode_interrupt_cb(void *opaque)
+{
+    VideoState *is = (VideoState *)opaque;
+
+    return is->quit;
+}
+
+static int demux_queues_full(VideoState *is)
+{
+    return !atomic_load(&is->seek_req) &&
+           (atomic_load(&is->audioq.size) + atomic_load(&is->videoq.size) > MAX_QUEUE_SIZE ||
+            (packet_queue_has_enough(&is->audioq, is->audioStream) &&
+             packet_queue_has_enough(&is->videoq, is->videoStream)));
+}
+
+/* has a stream not presented its last picture or sample since the
+   last seek yet? */
+static int demux_playing(VideoState *is)
+{
+    int serial = atomic_load(&is->seek_serial);
+
+    return (is->audioStream >= 0 && atomic_load(&is->audio_finished) != serial) ||
+           (is->videoStream >= 0 && atomic_load(&is->video_finished) != serial);
+}
+
+/* at the end of the input, nothing to do until a seek or the end */
+static int demux_idle(VideoState *is)
+{
+    return !atomic_load(&is->seek_req) && demux_playing(is);
+}
+
+/* Ask decode_thread to seek to pos (AV_TIME_BASE units). Only the last
+   of several requests made before it gets to them is carried out. */
+static void stream_seek(VideoState *is, int64_t pos)
+{
+    if (is->pFormatCtx->start_time != AV_NOPTS_VALUE && pos < is->pFormatCtx->start_time)
+    {
+        pos = is->pFormatCtx->start_time;
+    }
+
+    is->seek_pos = pos;
+    is->seek_start = av_gettime_relative();
+    atomic_store(&is->seek_req, 1);
+    demux_abort(&is->demux_space);
+}
+
+/* The demuxer's half of a seek. avformat_seek_file goes to the last
+   keyframe at or before the target, found in the stream's index: the
+   one the container carries, or the one libavformat builds while
+   demuxing formats without (AVFMT_GENERIC_INDEX). The decoders decode
+   forward from there and show nothing before seek_target. */
+static int demux_seek(VideoState *is)
+{
+    AVFormatContext *ic = is->pFormatCtx;
+    int stream = is->videoStream >= 0 ? is->videoStream : is->audioStream;
+    int64_t target = is->seek_pos;
+    int64_t ts = av_rescale_q(target, AV_TIME_BASE_Q, ic->streams[stream]->time_base);
+    int ret;
+
+    atomic_store(&is->seek_req, 0);
+
+    ret = avformat_seek_file(ic, stream, INT64_MIN, ts, ts, 0);
+
+    if (ret < 0)
+    {
+        /* nothing before the target: take the first keyframe after */
+        ret = avformat_seek_file(ic, stream, INT64_MIN, ts, INT64_MAX, 0);
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "%s: error while seeking\n", is->filename);
+        return -1;
+    }
+
+    is->seek_target = (double)target / AV_TIME_BASE;
+    is->seeks++;
+    atomic_fetch_add(&is->seek_serial, 1);
+    packet_queue_put_flush(&is->videoq, is->videoStream);
+    packet_queue_put_flush(&is->audioq, is->audioStream);
+
+    /* audio_thread may be in audio_wait_played_out */
+    if (is->audio_ring.space)
+    {
+        SDL_SemPost(is->audio_ring.space);
+    }
+
+    return 0;
+}
+
+int decode_thread(void *arg)
+{
+
+    VideoState *is = (VideoState *)arg;
+    AVFormatContext *pFormatCtx = NULL;
+    AVPacket pkt1, *packet = &pkt1;
+
+    AVIOInterruptCB callback;
+    AVIOContext *pb = NULL;
+
+    int video_index = -1;
+    int audio_index = -1;
+    int i, ret;
+    int eof = 0;
+    int64_t t;
+    AVDictionary *format_opts = NULL;
+
+    is->videoStream = -1;
+    is->audioStream = -1;
+    // will interrupt blocking functions if we quit!
+    callback.callback = decode_interrupt_cb;
+    callback.opaque = is;
+
+    /* is->io_context is always the top of what is stacked so far, for
+       stream_close_input to take apart */
+    if ((!use_mmap || mapped_input_open(is, is->filename) < 0) &&
+        (readahead_size || slow_io_ms) &&
+        avio_open2(&is->io_context, is->filename, AVIO_FLAG_READ, &callback, NULL) < 0)
+    {
+        fprintf(stderr, "Unable to open I/O for %s\n", is->filename);
+        goto fail;
+    }
+
+    pb = is->io_context;
+
+    // the slow-I/O stand-in and the read-ahead window stack on whichever input we have
+    if (pb && slow_io_ms)
+    {
+        if (!(pb = slow_input_open(is->io_context)))
+        {
+            goto fail;
+        }
+
+        is->io_context = pb;
+    }
+
+    if (pb && readahead_size)
+    {
+        if (!(pb = readahead_open(is, is->io_context, readahead_size)))
+        {
+            fprintf(stderr, "Unable to allocate a %d byte read-ahead window\n", readahead_size);
+            goto fail;
+        }
+
+        is->io_context = pb;
+    }
+
+    pFormatCtx = avformat_alloc_context();
+
+    if (!pFormatCtx)
+    {
+        goto fail;
+    }
+
+    pFormatCtx->interrupt_callback = callback;
+    pFormatCtx->pb = pb;
+
+    if (fast_start)
+    {
+        /* enough for the container header and a few packets of each
+           stream, instead of the default 5 MB / 5 s */
+        av_dict_set(&format_opts, "probesize", "131072", 0);
+        av_dict_set(&format_opts, "analyzeduration", "500000", 0);
+    }
+
+    // Open video file
+    t = av_gettime_relative();
+    ret = avformat_open_input(&pFormatCtx, is->filename, NULL, &format_opts);
+    av_dict_free(&format_opts);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "Unable to open %s\n", is->filename);
+        goto fail; // Couldn't open file
+    }
+
+    is->pFormatCtx = pFormatCtx;
+    is->open_time = av_gettime_relative() - t;
+
+    //printf("the duration is %ld\n", is->pFormatCtx->duration/AV_TIME_BASE);
+
+    // Retrieve stream information
+    t = av_gettime_relative();
+
+    if (probe_streams(is, pFormatCtx) < 0)
+    {
+        goto fail; // Couldn't find stream information
+    }
+
+    is->probe_time = av_gettime_relative() - t;
+
+    // Dump information about file onto standard error
+    if (!fast_start)
+    {
+        av_dump_format(pFormatCtx, 0, is->filename, 0);
+    }
+
+    // Find the first video stream
+
+    for (i = 0; i < pFormatCtx->nb_streams; i++)
+    {
+        if (pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
+            video_index < 0)
+        {
+            video_index = i;
+        }
+
+        if (pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO &&
+            audio_index < 0)
+        {
+            audio_index = i;
+        }
+    }
+
+    if (audio_index >= 0 && !is->audio_disable)
+    {
+        stream_component_open(is, audio_index);
+    }
+
+    if (video_index >= 0)
+    {
+        stream_component_open(is, video_index);
+    }
+
+    if (is->videoStream < 0 && is->audioStream < 0)
+    {
+        fprintf(stderr, "%s: could not open codecs\n", is->filename);
+        goto fail;
+    }
+
+    if (is->audioStream >= 0)
+    {
+        /* a few device buffers, and at least 1/8 s, of decoded audio
+           between audio_thread and the callback */
+        if (audio_ring_init(&is->audio_ring, is->audio_frame_bytes,
+                            FFMAX(4 * is->audio_hw_buf_size,
+                                  is->audio_out_rate * is->audio_frame_bytes / 8)) < 0)
+        {
+            fprintf(stderr, "Could not allocate the audio ring\n");
+            goto fail;
+        }
+
+        is->audio_tid = create_thread(audio_thread, is);
+
+        if (!headless)
+        {
+            /* a pre-opened item waits its turn in audio_next */
+            atomic_store(&is->audio_ready, 1);
+
+            if (!nb_mosaic && atomic_load(&audio_source) != is)
+            {
+                atomic_store(&audio_next, is);
+            }
+
+            SDL_PauseAudio(0);
+        }
+    }
+
+    // main decode loop
+
+    for (;;)
+    {
+        if (is->quit)
+        {
+
+            break;
+        }
+
+        if (atomic_load(&is->seek_req))
+        {
+            if (demux_seek(is) == 0)
+            {
+                eof = 0;
+            }
+
+            continue;
+        }
+
+        if (eof)
+        {
+            if (!demux_playing(is))
+            {
+                break;
+            }
+
+            demux_wait(is, demux_idle);
+            continue;
+        }
+
+        if (demux_queues_full(is))
+        {
+            demux_wait(is, demux_queues_full);
+            continue;
+        }
+
+        t = av_gettime_relative();
+        ret = av_read_frame(is->pFormatCtx, packet);
+        histogram_add(&is->stage_hist[STAGE_DEMUX], av_gettime_relative() - t);
+
+        if (ret < 0)
+        {
+            if (is->pFormatCtx->pb && is->pFormatCtx->pb->error)
+            {
+                fprintf(stderr, "Error reading %s, playing what was read\n", is->filename);
+            }
+
+            /* drain the decoders and wait for both streams to finish,
+               or a seek */
+            packet_queue_put_eos(&is->videoq, is->videoStream);
+            packet_queue_put_eos(&is->audioq, is->audioStream);
+            eof = 1;
+            continue;
+        }
+
+        // Is this a packet from the video stream?
+        if (packet->stream_index == is->videoStream)
+        {
+            packet_queue_put(&is->videoq, packet);
+        }
+        else if (packet->stream_index == is->audioStream)
+        {
+            packet_queue_put(&is->audioq, packet);
+        }
+        else
+        {
+            av_packet_unref(packet);
+        }
+    }
+
+fail:
+    if (headless)
+    {
+        /* wake the decoders so they see quit and return */
+        stream_abort(is);
+    }
+    else if (!is->quit)
+    {
+        /* played out or failed to open: main moves on to the next item */
+        SDL_Event event;
+        event.type = FF_QUIT_EVENT;
+        event.user.data1 = is;
+        event.user.code = is->generation;
+        SDL_PushEvent(&event);
+    }
+
+    return 0;
+}
+
+static void stats_write_histogram(FILE *f, Histogram *h)
+{
+    fprintf(f, "{\"count\": %lld, \"total\": %lld, \"p50\": %lld, \"p99\": %lld, \"max\": %lld}",
+            (long long)atomic_load(&h->count), (long long)atomic_load(&h->sum),
+            (long long)histogram_percentile(h, 0.50),
+            (long long)histogram_percentile(h, 0.99),
+            (long long)atomic_load(&h->max));
+}
+
+/* time to first frame since main started, -1 if none yet */
+static double first_frame_ms(VideoState *is)
+{
+    int64_t t = atomic_load(&is->first_frame_time);
+
+    return t ? (t - is->launch_time) / 1000.0 : -1.0;
+}
+
+/* memory traffic of the audio path after decoding: every byte written
+   or read by swr_convert's output, a copy or a clear */
+static double audio_bytes_touched_per_sec(VideoState *is)
+{
+    double secs;
+
+    if (!is->audio_st || !is->audio_samples)
+    {
+        return 0;
+    }
+
+    secs = (double)is->audio_samples / is->audio_st->codec->sample_rate;
+    return atomic_load(&is->audio_bytes_touched) / secs;
+}
+
+/* Write the stage histograms, queue gauges and counters as JSON. The
+   file is replaced atomically so a reader never sees half of it. */
+static int stats_write_json(VideoState *is, const char *path)
+{
+    char tmp_path[1100];
+    FILE *f;
+    int i;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    f = fopen(tmp_path, "w");
+
+    if (!f)
+    {
+        fprintf(stderr, "Could not write stats to %s\n", tmp_path);
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"stages_us\": {\n");
+
+    for (i = 0; i < STAGE_NB; i++)
+    {
+        fprintf(f, "    \"%s\": ", stage_names[i]);
+        stats_write_histogram(f, &is->stage_hist[i]);
+        fprintf(f, "%s\n", i + 1 < STAGE_NB ? "," : "");
+    }
+
+    fprintf(f, "  },\n  \"present_wakeup_error_us\": ");
+    stats_write_histogram(f, &is->present_wakeup_error);
+    fprintf(f, ",\n  \"av_offset_us\": ");
+    stats_write_histogram(f, &is->av_offset);
+    fprintf(f, ",\n  \"av_offset_last_ms\": %.3f,\n  \"av_offset_mean_ms\": %.3f,\n",
+            is->av_offset_last * 1000.0,
+            is->av_offset_count ? is->av_offset_sum * 1000.0 / is->av_offset_count : 0.0);
+    fprintf(f, "  \"audio_compensations\": %d,\n", is->audio_compensations);
+    fprintf(f, "  \"startup_ms\": {\"open\": %.1f, \"stream_info\": %.1f, \"first_frame\": %.1f, \"probe_cache\": \"%s\"},\n",
+            is->open_time / 1000.0, is->probe_time / 1000.0,
+            first_frame_ms(is),
+            !probe_cache_dir ? "off" : is->probe_cache_hit ? "hit" : "miss");
+    fprintf(f, "  \"seeks\": %d,\n  \"seek_frames_skipped\": %d,\n  \"seek_latency_us\": ",
+            is->seeks, is->seek_frames_skipped);
+    stats_write_histogram(f, &is->seek_latency);
+    fprintf(f, ",\n");
+
+    if (is->readahead)
+    {
+        ReadAhead *ra = is->readahead;
+
+        fprintf(f, "  \"readahead\": {\"window\": %d, \"reads\": %lld, \"hit_rate\": %.4f, "
+                   "\"seeks_in_window\": %d, \"seeks_refill\": %d, \"stall_us\": ",
+                ra->size, (long long)ra->reads,
+                ra->reads ? 1.0 - (double)ra->stalled_reads / ra->reads : 0.0,
+                ra->seeks_in_window, ra->seeks_refill);
+        stats_write_histogram(f, &ra->stall);
+        fprintf(f, "},\n");
+    }
+
+    fprintf(f, "  \"queues\": {\n");
+
+    for (i = 0; i < GAUGE_NB; i++)
+    {
+        Gauge *g = &is->gauges[i];
+        int64_t samples = atomic_load(&g->samples);
+
+        fprintf(f, "    \"%s\": {\"last\": %d, \"max\": %d, \"mean\": %.2f}%s\n",
+                gauge_names[i], atomic_load(&g->last), atomic_load(&g->max),
+                samples ? (double)atomic_load(&g->sum) / samples : 0.0,
+                i + 1 < GAUGE_NB ? "," : "");
+    }
+
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"frame_drops\": {\"display\": %d, \"decode\": %d, \"nonref\": %d},\n",
+            is->frame_drops[FRAME_DROP_DISPLAY],
+            is->frame_drops[FRAME_DROP_DECODE],
+            is->frame_drops[FRAME_DROP_NONREF]);
+    fprintf(f, "  \"video_frames\": %d,\n", is->video_frames);
+    fprintf(f, "  \"audio_samples\": %lld,\n", (long long)is->audio_samples);
+    fprintf(f, "  \"audio_underruns\": %d,\n", is->audio_underruns);
+    fprintf(f, "  \"audio_bytes_touched_per_sec\": %.0f,\n", audio_bytes_touched_per_sec(is));
+    fprintf(f, "  \"packet_bytes_copied\": %lld\n}\n",
+            (long long)(is->audioq.bytes_copied + is->videoq.bytes_copied));
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Could not write stats to %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* rewrites stats_path every stats_interval ms while playing */
+static int stats_thread(void *arg)
+{
+    VideoState *is = (VideoState *)arg;
+
+    while (SDL_SemWaitTimeout(is->stats_wake, stats_interval) == SDL_MUTEX_TIMEDOUT &&
+           !is->quit)
+    {
+        stats_write_json(is, is->stats_file);
+    }
+
+    return 0;
+}
+
+static void print_stats(VideoState *is)
+{
+    if (is->tile >= 0)
+    {
+        fprintf(stderr, "%s:\n", is->filename);
+    }
+
+    fprintf(stderr, "packet path: %lld bytes copied (audio %lld, video %lld)\n",
+            (long long)(is->audioq.bytes_copied + is->videoq.bytes_copied),
+            (long long)is->audioq.bytes_copied,
+            (long long)is->videoq.bytes_copied);
+    fprintf(stderr, "frames dropped: %d late at display, %d late after decode, %d non-reference skipped\n",
+            is->frame_drops[FRAME_DROP_DISPLAY],
+            is->frame_drops[FRAME_DROP_DECODE],
+            is->frame_drops[FRAME_DROP_NONREF]);
+    fprintf(stderr, "audio: %d underruns, %.0f PCM bytes touched per second of audio\n",
+            is->audio_underruns, audio_bytes_touched_per_sec(is));
+    fprintf(stderr, "a/v offset: last %.1f ms, mean %.1f ms, p99 |offset| %.1f ms, %d drift corrections\n",
+            is->av_offset_last * 1000.0,
+            is->av_offset_count ? is->av_offset_sum * 1000.0 / is->av_offset_count : 0.0,
+            histogram_percentile(&is->av_offset, 0.99) / 1000.0,
+            is->audio_compensations);
+
+    fprintf(stderr, "startup: open %.1f ms, stream info %.1f ms%s, first frame at %.1f ms\n",
+            is->open_time / 1000.0, is->probe_time / 1000.0,
+            !probe_cache_dir ? "" : is->probe_cache_hit ? " (probe cache hit)" : " (probe cache miss)",
+            first_frame_ms(is));
+
+    if (is->seeks)
+    {
+        fprintf(stderr, "seeks: %d, to first picture p50 %.1f ms, p99 %.1f ms, %d frames decoded and not shown, %d entries in the video index\n",
+                is->seeks,
+                histogram_percentile(&is->seek_latency, 0.50) / 1000.0,
+                histogram_percentile(&is->seek_latency, 0.99) / 1000.0,
+                is->seek_frames_skipped,
+                is->video_st ? is->video_st->nb_index_entries : 0);
+    }
+
+    if (is->readahead)
+    {
+        ReadAhead *ra = is->readahead;
+
+        fprintf(stderr, "read-ahead: %lld reads, %.1f%% served from the window, %lld stalls for %.1f ms (p99 %.1f ms), %d/%d seeks inside the window\n",
+                (long long)ra->reads,
+                ra->reads ? 100.0 - 100.0 * ra->stalled_reads / ra->reads : 0.0,
+                (long long)atomic_load(&ra->stall.count),
+                atomic_load(&ra->stall.sum) / 1000.0,
+                histogram_percentile(&ra->stall, 0.99) / 1000.0,
+                ra->seeks_in_window, ra->seeks_in_window + ra->seeks_refill);
+    }
+
+    if (stats_path)
+    {
+        /* stats_thread writes the same file: stop it before the last write */
+        if (is->stats_tid)
+        {
+            is->quit = 1;
+            SDL_SemPost(is->stats_wake);
+            SDL_WaitThread(is->stats_tid, NULL);
+            is->stats_tid = NULL;
+        }
+
+        stats_write_json(is, is->stats_file);
+    }
+}
+
+static void headless_report(VideoState *is, int64_t elapsed)
+{
+    double secs = elapsed / 1000000.0;
+    int i;
+
+    printf("headless: %.3f s wall clock\n", secs);
+    printf("  video: %d frames, %.1f frames/s\n", is->video_frames, is->video_frames / secs);
+    printf("  audio: %lld samples, %.0f samples/s\n", (long long)is->audio_samples, is->audio_samples / secs);
+
+    for (i = 0; i < STAGE_NB; i++)
+    {
+        printf("  %-15s %9.3f s\n", stage_names[i], atomic_load(&is->stage_hist[i].sum) / 1000000.0);
+    }
+}
+
+/* Undo decode_thread's I/O stack, top layer first. Each of our own
+   layers is recognised by its read callback and reads from the one
+   below; the bottom is either the mapping or an avio_open2 context. */
+static void stream_close_input(VideoState *is)
+{
+    AVIOContext *pb = is->io_context;
+
+    while (pb)
+    {
+        AVIOContext *below = NULL;
+
+        if (pb->read_packet == readahead_read)
+        {
+            ReadAhead *ra = (ReadAhead *)pb->opaque;
+
+            SDL_WaitThread(ra->tid, NULL);
+            below = ra->src;
+            av_free(ra->buf);
+            SDL_DestroyMutex(ra->mutex);
+            SDL_DestroyCond(ra->cond);
+            av_free(ra);
+        }
+        else if (pb->read_packet == slow_input_read)
+        {
+            below = (AVIOContext *)pb->opaque;
+        }
+#ifndef _WIN32
+        else if (pb->read_packet == mapped_input_read)
+        {
+            MappedInput *m = (MappedInput *)pb->opaque;
+
+            munmap(m->data, m->size);
+            av_free(m);
+        }
+#endif
+        else
+        {
+            avio_closep(&pb);
+            break;
+        }
+
+        av_freep(&pb->buffer);
+        av_freep(&pb);
+        pb = below;
+    }
+
+    is->io_context = NULL;
+    is->mapped = NULL;
+    is->readahead = NULL;
+}
+
+static void stream_join(VideoState *is)
+{
+    SDL_Thread **tids[] = {&is->parse_tid, &is->video_tid, &is->audio_tid,
+                           &is->present_tid, &is->stats_tid};
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(tids); i++)
+    {
+        if (*tids[i])
+        {
+            SDL_WaitThread(*tids[i], NULL);
+            *tids[i] = NULL;
+        }
+    }
+}
+
+/* Stop is and free everything it holds, is itself included. */
+static void stream_close(VideoState *is)
+{
+    int i;
+
+    if (!headless)
+    {
+        /* after this the callback no longer looks at is */
+        SDL_LockAudio();
+
+        if (atomic_load(&audio_source) == is)
+        {
+            atomic_store(&audio_source, NULL);
+        }
+
+        if (atomic_load(&audio_next) == is)
+        {
+            atomic_store(&audio_next, NULL);
+        }
+
+        SDL_UnlockAudio();
+    }
+
+    stream_abort(is);
+    stream_join(is);
+
+    if (is->audio_st)
+    {
+        avcodec_close(is->audio_st->codec);
+    }
+
+    if (is->video_st)
+    {
+        avcodec_close(is->video_st->codec);
+    }
+
+    avformat_close_input(&is->pFormatCtx);
+    stream_close_input(is);
+
+    SDL_LockMutex(screen_mutex);
+
+    for (i = 0; i < VIDEO_PICTURE_QUEUE_SIZE_MAX; i++)
+    {
+        if (is->pictq[i].bmp)
+        {
+#ifdef USE_SDL2
+            SDL_DestroyTexture(is->pictq[i].bmp);
+#else
+            SDL_FreeYUVOverlay(is->pictq[i].bmp);
+#endif
+        }
+
+#ifdef USE_SDL2
+        av_freep(&is->pictq[i].pict.data[0]);
+        av_frame_free(&is->pictq[i].frame);
+#endif
+    }
+
+    SDL_UnlockMutex(screen_mutex);
+
+    av_freep(&is->headless_pict.data[0]);
+    scale_pool_free(&is->scale_pool);
+    swr_free(&is->pSwrCtx);
+    av_freep(&is->audio_ring.buf);
+
+    if (is->audio_ring.space)
+    {
+        SDL_DestroySemaphore(is->audio_ring.space);
+    }
+
+    av_frame_unref(&is->audio_frame);
+    av_packet_unref(&is->audio_pkt);
+
+    packet_queue_destroy(&is->audioq);
+    packet_queue_destroy(&is->videoq);
+    SDL_DestroyMutex(is->pictq_mutex);
+    SDL_DestroyCond(is->pictq_cond);
+    SDL_DestroyMutex(is->demux_space.mutex);
+    SDL_DestroyCond(is->demux_space.cond);
+    SDL_DestroySemaphore(is->stats_wake);
+    av_free(is);
+}
+
+/* items started so far, main thread only */
+static int stream_generation;
+
+/* Everything one playlist item needs, and its demuxer started. In the
+   player it only decodes up to full queues until stream_activate. */
+static VideoState *stream_start(const char *filename, int tile)
+{
+    VideoState *is = av_mallocz(sizeof(VideoState));
+
+    if (!is)
+    {
+        return NULL;
+    }
+
+    av_strlcpy(is->filename, filename, sizeof(is->filename));
+    is->tile = tile;
+    is->generation = ++stream_generation;
+    is->audio_disable = tile >= 0 && audio_tile >= 0 && tile != audio_tile;
+
+    if (tile >= 0 && stats_path)
+    {
+        snprintf(is->stats_file, sizeof(is->stats_file), "%s.%d", stats_path, tile);
+    }
+    else if (stats_path)
+    {
+        av_strlcpy(is->stats_file, stats_path, sizeof(is->stats_file));
+    }
+    is->launch_time = av_gettime_relative();
+    is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
+
+    is->pictq_max = pictq_depth;
+    is->pictq_mutex = SDL_CreateMutex();
+    is->pictq_cond = SDL_CreateCond();
+    is->demux_space.mutex = SDL_CreateMutex();
+    is->demux_space.cond = SDL_CreateCond();
+    is->stats_wake = SDL_CreateSemaphore(0);
+    packet_queue_init(&is->audioq);
+    packet_queue_init(&is->videoq);
+    atomic_init(&is->video_eos, -1);
+    atomic_init(&is->audio_eos, -1);
+    atomic_init(&is->video_finished, -1);
+    atomic_init(&is->audio_finished, -1);
+    atomic_init(&is->audio_played_out, -1);
+    is->video_skip_until = is->audio_skip_until = -INFINITY;
+
+    is->parse_tid = create_thread(decode_thread, is);
+
+    if (!is->parse_tid)
+    {
+        fprintf(stderr, "%s: could not start the demuxer\n", filename);
+        stream_close(is);
+        return NULL;
+    }
+
+    return is;
+}
+
+/* is becomes what is shown and heard */
+static void stream_activate(VideoState *is)
+{
+    /* pictures were timed from when the item was opened */
+    is->frame_timer = (double)monotonic_time() / 1000000.0;
+    is->video_current_pts_time = av_gettime();
+
+    if (!is->audio_disable)
+    {
+        SDL_LockAudio();
+        atomic_store(&audio_source, is);
+
+        if (atomic_load(&audio_next) == is)
+        {
+            atomic_store(&audio_next, NULL);
+        }
+
+        SDL_UnlockAudio();
+    }
+
+    is->present_tid = create_thread(presentation_thread, is);
+
+    if (stats_path && stats_interval > 0)
+    {
+        is->stats_tid = create_thread(stats_thread, is);
+    }
+}
+
+#ifdef __BENCHMARK__
+/* Micro-benchmarks, built with -D__BENCHMARK__ and run as
+   "videoplayer -bench <name>". They only exercise the pieces named and
+   need neither a display nor an input file. */
+
+#define BENCH_QUEUE_PACKETS 2000000
+
+/* The original mutex-protected linked-list PacketQueue, kept here only
+   as the baseline for the ring buffer. */
+typedef struct LegacyPacketQueue
+{
+    AVPacketList *first_pkt, *last_pkt;
+    int nb_packets;
+    int size;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+} LegacyPacketQueue;
+
+static void legacy_queue_put(LegacyPacketQueue *q, AVPacket *pkt)
+{
+    AVPacketList *pkt1 = av_malloc(sizeof(AVPacketList));
+
+    pkt1->pkt = *pkt;
+    pkt1->next = NULL;
+
+    SDL_LockMutex(q->mutex);
+
+    if (!q->last_pkt)
+    {
+        q->first_pkt = pkt1;
+    }
     else
     {
-        schedule_refresh(is, 100);
+        q->last_pkt->next = pkt1;
+    }
+
+    q->last_pkt = pkt1;
+    q->nb_packets++;
+    q->size += pkt1->pkt.size;
+    SDL_CondSignal(q->cond);
+
+    SDL_UnlockMutex(q->mutex);
+}
+
+static void legacy_queue_get(LegacyPacketQueue *q, AVPacket *pkt)
+{
+    AVPacketList *pkt1;
+
+    SDL_LockMutex(q->mutex);
+
+    while (!(pkt1 = q->first_pkt))
+    {
+        SDL_CondWait(q->cond, q->mutex);
+    }
+
+    q->first_pkt = pkt1->next;
+
+    if (!q->first_pkt)
+    {
+        q->last_pkt = NULL;
+    }
+
+    q->nb_packets--;
+    q->size -= pkt1->pkt.size;
+    *pkt = pkt1->pkt;
+    av_free(pkt1);
+
+    SDL_UnlockMutex(q->mutex);
+}
+
+static int bench_legacy_producer(void *arg)
+{
+    AVPacket pkt;
+    int i;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    for (i = 0; i < BENCH_QUEUE_PACKETS; i++)
+    {
+        pkt.pts = i;
+        legacy_queue_put(arg, &pkt);
+    }
+
+    return 0;
+}
+
+static int bench_ring_producer(void *arg)
+{
+    AVPacket pkt;
+    int i;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    for (i = 0; i < BENCH_QUEUE_PACKETS; i++)
+    {
+        pkt.pts = i;
+        packet_queue_put(arg, &pkt);
+    }
+
+    return 0;
+}
+
+static void bench_queue(void)
+{
+    LegacyPacketQueue lq;
+    PacketQueue rq;
+    SDL_Thread *producer;
+    AVPacket pkt;
+    int64_t start, legacy_us, ring_us;
+    int i;
+
+    memset(&lq, 0, sizeof(lq));
+    lq.mutex = SDL_CreateMutex();
+    lq.cond = SDL_CreateCond();
+
+    start = av_gettime();
+    producer = create_thread(bench_legacy_producer, &lq);
+
+    for (i = 0; i < BENCH_QUEUE_PACKETS; i++)
+    {
+        legacy_queue_get(&lq, &pkt);
     }
-}
 
-void alloc_picture(void *userdata)
-{
+    SDL_WaitThread(producer, NULL);
+    legacy_us = av_gettime() - start;
 
-    VideoState *is = (VideoState *)userdata;
-    VideoPicture *vp;
+    packet_queue_init(&rq);
 
-    vp = &is->pictq[is->pictq_windex];
+    start = av_gettime();
+    producer = create_thread(bench_ring_producer, &rq);
 
-    if (vp->bmp)
+    for (i = 0; i < BENCH_QUEUE_PACKETS; i++)
     {
-        // we already have one make another, bigger/smaller
-        SDL_FreeYUVOverlay(vp->bmp);
+        packet_queue_get(&rq, &pkt, 1);
     }
 
-    // Allocate a place to put our YUV image on that screen
-    vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
-                                   is->video_st->codec->height,
-                                   SDL_YV12_OVERLAY,
-                                   screen);
-    vp->width = is->video_st->codec->width;
-    vp->height = is->video_st->codec->height;
+    SDL_WaitThread(producer, NULL);
+    ring_us = av_gettime() - start;
 
-    SDL_LockMutex(is->pictq_mutex);
-    vp->allocated = 1;
-    SDL_CondSignal(is->pictq_cond);
-    SDL_UnlockMutex(is->pictq_mutex);
+    printf("queue: %d packets, 1 producer / 1 consumer\n", BENCH_QUEUE_PACKETS);
+    printf("  linked list + mutex: %8.1f ns/packet\n", legacy_us * 1000.0 / BENCH_QUEUE_PACKETS);
+    printf("  spsc ring:           %8.1f ns/packet\n", ring_us * 1000.0 / BENCH_QUEUE_PACKETS);
 }
 
-int queue_picture(VideoState *is, AVFrame *pFrame, double pts)
-{
-
-    VideoPicture *vp;
-    AVPicture pict;
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 200
 
-    /* wait until we have space for a new pic */
-    SDL_LockMutex(is->pictq_mutex);
+static double bench_repack_run(AVFrame *src, uint8_t *dst[4], int dst_linesize[4])
+{
+    int64_t start = av_gettime_relative();
+    int i;
 
-    while (is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
-           !is->quit)
+    for (i = 0; i < BENCH_FRAMES; i++)
     {
-        SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+        repack_picture(src, dst, dst_linesize, BENCH_WIDTH, BENCH_HEIGHT);
     }
 
-    SDL_UnlockMutex(is->pictq_mutex);
+    return (av_gettime_relative() - start) / 1000.0 / BENCH_FRAMES;
+}
 
-    if (is->quit)
-    {
-        return -1;
-    }
+static void bench_repack(void)
+{
+    static const enum AVPixelFormat formats[] = {
+        AV_PIX_FMT_NV12, AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_YUV420P};
+    AVFrame *src = av_frame_alloc();
+    uint8_t *dst[4];
+    int dst_linesize[4];
+    RepackKernels best;
+    int f, i;
 
-    // windex is set to 0 initially
-    vp = &is->pictq[is->pictq_windex];
+    repack_init();
+    best = repack;
+    av_image_alloc(dst, dst_linesize, BENCH_WIDTH, BENCH_HEIGHT, AV_PIX_FMT_YUV420P, 32);
 
-    /* allocate or resize the buffer! */
-    if (!vp->bmp ||
-        vp->width != is->video_st->codec->width ||
-        vp->height != is->video_st->codec->height)
-    {
-        SDL_Event event;
+    printf("repack to yv12: %dx%d, ms per frame\n", BENCH_WIDTH, BENCH_HEIGHT);
 
-        vp->allocated = 0;
-        /* we have to do it in the main thread */
-        event.type = FF_ALLOC_EVENT;
-        event.user.data1 = is;
-        SDL_PushEvent(&event);
+    for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        struct SwsContext *sws;
+        double c_ms, simd_ms, sws_ms;
+        int64_t start;
 
-        /* wait until we have a picture allocated */
-        SDL_LockMutex(is->pictq_mutex);
+        src->format = formats[f];
+        src->width = BENCH_WIDTH;
+        src->height = BENCH_HEIGHT;
+        av_image_alloc(src->data, src->linesize, BENCH_WIDTH, BENCH_HEIGHT, formats[f], 32);
 
-        while (!vp->allocated && !is->quit)
+        for (i = 0; i < 4 && src->data[i]; i++)
         {
-            SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+            memset(src->data[i], 0x40 + 0x20 * i, src->linesize[i]);
         }
 
-        SDL_UnlockMutex(is->pictq_mutex);
+        repack = (RepackKernels){"c", deinterleave_uv_c, range_luma_c, range_chroma_c};
+        c_ms = bench_repack_run(src, dst, dst_linesize);
+        repack = best;
+        simd_ms = bench_repack_run(src, dst, dst_linesize);
 
-        if (is->quit)
+        sws = sws_getContext(BENCH_WIDTH, BENCH_HEIGHT, formats[f],
+                             BENCH_WIDTH, BENCH_HEIGHT, AV_PIX_FMT_YUV420P,
+                             SWS_BILINEAR, NULL, NULL, NULL);
+        start = av_gettime_relative();
+
+        for (i = 0; i < BENCH_FRAMES; i++)
         {
-            return -1;
+            sws_scale(sws, (uint8_t const *const *)src->data, src->linesize,
+                      0, BENCH_HEIGHT, dst, dst_linesize);
         }
+
+        sws_ms = (av_gettime_relative() - start) / 1000.0 / BENCH_FRAMES;
+        sws_freeContext(sws);
+
+        printf("  %-9s c %7.3f   %-4s %7.3f   sws_scale %7.3f\n",
+               av_get_pix_fmt_name(formats[f]), c_ms, best.name, simd_ms, sws_ms);
+
+        av_freep(&src->data[0]);
     }
 
-    /* We have a place to put our picture on the queue */
-    /* If we are skipping a frame, do we set this to null
-       but still return vp->allocated = 1? */
+    av_freep(&dst[0]);
+    av_frame_free(&src);
+}
 
-    if (vp->bmp)
-    {
+#define BENCH_SCALE_WIDTH 3840
+#define BENCH_SCALE_HEIGHT 2160
+#define BENCH_SCALE_FRAMES 50
+
+static void bench_scale(void)
+{
+    uint8_t *src[4], *dst[4];
+    int src_linesize[4], dst_linesize[4];
+    double single_ms = 0;
+    int threads, i;
 
-        SDL_LockYUVOverlay(vp->bmp);
+    av_image_alloc(src, src_linesize, BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT, AV_PIX_FMT_YUV422P, 32);
+    av_image_alloc(dst, dst_linesize, BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT, AV_PIX_FMT_YUV420P, 32);
 
-        /* point pict at the queue */
+    for (i = 0; i < 3; i++)
+    {
+        memset(src[i], 0x40 + 0x20 * i, src_linesize[i] * BENCH_SCALE_HEIGHT);
+    }
 
-        pict.data[0] = vp->bmp->pixels[0];
-        pict.data[1] = vp->bmp->pixels[2];
-        pict.data[2] = vp->bmp->pixels[1];
+    printf("sws_scale yuv422p -> yuv420p: %dx%d, ms per frame\n",
+           BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT);
 
-        pict.linesize[0] = vp->bmp->pitches[0];
-        pict.linesize[1] = vp->bmp->pitches[2];
-        pict.linesize[2] = vp->bmp->pitches[1];
+    for (threads = 1; threads <= FFMIN(av_cpu_count(), SCALE_THREADS_MAX); threads *= 2)
+    {
+        ScalePool pool;
+        double ms;
+        int64_t start;
 
-        // Convert the image into YUV format that SDL uses
-        sws_scale(
-            is->sws_ctx,
-            (uint8_t const *const *)pFrame->data,
-            pFrame->linesize,
-            0,
-            is->video_st->codec->height,
-            pict.data,
-            pict.linesize);
+        if (scale_pool_init(&pool, threads, BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT, AV_PIX_FMT_YUV422P,
+                            BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT) < 0)
+        {
+            break;
+        }
 
-        SDL_UnlockYUVOverlay(vp->bmp);
-        vp->pts = pts;
+        start = av_gettime_relative();
 
-        /* now we inform our display thread that we have a pic ready */
-        if (++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE)
+        for (i = 0; i < BENCH_SCALE_FRAMES; i++)
         {
-            is->pictq_windex = 0;
+            scale_pool_run(&pool, src, src_linesize, dst, dst_linesize);
         }
 
-        SDL_LockMutex(is->pictq_mutex);
-        is->pictq_size++;
-        SDL_UnlockMutex(is->pictq_mutex);
+        ms = (av_gettime_relative() - start) / 1000.0 / BENCH_SCALE_FRAMES;
+        single_ms = threads == 1 ? ms : single_ms;
+        printf("  %2d threads %8.3f  (x%.2f)\n", pool.nb_workers, ms, single_ms / ms);
+        scale_pool_free(&pool);
     }
 
-    return 0;
+    av_freep(&src[0]);
+    av_freep(&dst[0]);
 }
 
-double synchronize_video(VideoState *is, AVFrame *src_frame, double pts)
-{
+#define BENCH_SAMPLES_RATE 48000
+#define BENCH_SAMPLES_FRAME 1024
+#define BENCH_SAMPLES_SECONDS 60
 
-    double frame_delay;
+static double bench_samples_run(int fltp, const uint8_t *const *src, int16_t *dst)
+{
+    int frames = BENCH_SAMPLES_RATE * BENCH_SAMPLES_SECONDS / BENCH_SAMPLES_FRAME;
+    int64_t start = av_gettime_relative();
+    int i;
 
-    if (pts != 0)
+    for (i = 0; i < frames; i++)
     {
-        /* if we have pts, set video clock to it */
-        is->video_clock = pts;
+        if (fltp)
+        {
+            sample_kernels.fltp_to_s16(dst, (const float *const *)src, 2, BENCH_SAMPLES_FRAME);
+        }
+        else
+        {
+            sample_kernels.s16p_to_s16(dst, (const int16_t *const *)src, 2, BENCH_SAMPLES_FRAME);
+        }
     }
-    else
+
+    return (av_gettime_relative() - start) / 1000.0;
+}
+
+static void bench_samples(void)
+{
+    static const enum AVSampleFormat formats[] = {AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16P};
+    float l[BENCH_SAMPLES_FRAME], r[BENCH_SAMPLES_FRAME];
+    int16_t ls[BENCH_SAMPLES_FRAME], rs[BENCH_SAMPLES_FRAME];
+    int16_t out_c[2 * BENCH_SAMPLES_FRAME], out[2 * BENCH_SAMPLES_FRAME];
+    SampleKernels best;
+    int f, i;
+
+    sample_convert_init();
+    best = sample_kernels;
+
+    /* past full scale on purpose, the kernels must clip alike */
+    for (i = 0; i < BENCH_SAMPLES_FRAME; i++)
     {
-        /* if we aren't given a pts, set it to the clock */
-        pts = is->video_clock;
+        l[i] = 1.1f * sinf(i * 0.05f);
+        r[i] = 1.1f * cosf(i * 0.03f);
+        ls[i] = (int16_t)(l[i] * 30000);
+        rs[i] = (int16_t)(r[i] * 30000);
     }
 
-    /* update the video clock */
-    frame_delay = av_q2d(is->video_st->codec->time_base);
-    /* if we are repeating a frame, adjust clock accordingly */
-    frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
-    is->video_clock += frame_delay;
-    return pts;
-}
+    printf("stereo %d Hz to interleaved s16: %d s of audio, ms\n",
+           BENCH_SAMPLES_RATE, BENCH_SAMPLES_SECONDS);
 
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
+    for (f = 0; f < 2; f++)
+    {
+        const uint8_t *src[2];
+        SwrContext *swr;
+        double c_ms, simd_ms, swr_ms;
+        int frames = BENCH_SAMPLES_RATE * BENCH_SAMPLES_SECONDS / BENCH_SAMPLES_FRAME;
+        int64_t start;
+        uint8_t *dst = (uint8_t *)out;
+
+        src[0] = formats[f] == AV_SAMPLE_FMT_FLTP ? (uint8_t *)l : (uint8_t *)ls;
+        src[1] = formats[f] == AV_SAMPLE_FMT_FLTP ? (uint8_t *)r : (uint8_t *)rs;
+
+        sample_kernels = (SampleKernels){"c", fltp_to_s16_c, s16p_to_s16_c};
+        c_ms = bench_samples_run(formats[f] == AV_SAMPLE_FMT_FLTP, src, out_c);
+        sample_kernels = best;
+        simd_ms = bench_samples_run(formats[f] == AV_SAMPLE_FMT_FLTP, src, out);
+
+        swr = swr_alloc_set_opts(NULL, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, BENCH_SAMPLES_RATE,
+                                 AV_CH_LAYOUT_STEREO, formats[f], BENCH_SAMPLES_RATE, 0, NULL);
+        swr_init(swr);
+        start = av_gettime_relative();
+
+        for (i = 0; i < frames; i++)
+        {
+            swr_convert(swr, &dst, BENCH_SAMPLES_FRAME, src, BENCH_SAMPLES_FRAME);
+        }
 
-/* These are called whenever we allocate a frame
- * buffer. We use this to store the global_pts in
- * a frame at the time it is allocated.
- */
+        swr_ms = (av_gettime_relative() - start) / 1000.0;
+        swr_free(&swr);
 
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic, int flags)
-{
-    int ret = avcodec_default_get_buffer2(c, pic, flags);
-    uint64_t *pts = av_malloc(sizeof(uint64_t));
-    *pts = global_video_pkt_pts;
-    pic->opaque = pts;
-    return ret;
+        printf("  %-5s c %8.3f   %-4s %8.3f   swr_convert %8.3f%s\n",
+               av_get_sample_fmt_name(formats[f]), c_ms, best.name, simd_ms, swr_ms,
+               memcmp(out_c, out, sizeof(out)) ? "   MISMATCH" : "");
+    }
 }
 
-int video_thread(void *arg)
+int run_benchmark(const char *name)
 {
-    VideoState *is = (VideoState *)arg;
-    AVPacket pkt1, *packet = &pkt1;
-    int frameFinished;
-    AVFrame *pFrame;
-    double pts;
-
-    pFrame = av_frame_alloc();
-
-    // start of islem patch fix video quit
-    long int temp_packet = 0;
-    int packet_step = 0;
-    int videoFPS = av_q2d(is->pFormatCtx->streams[is->videoStream]->r_frame_rate);
-    int video_duration = is->pFormatCtx->duration / AV_TIME_BASE;
+    if (!strcmp(name, "queue"))
+    {
+        bench_queue();
+    }
+    else if (!strcmp(name, "repack"))
+    {
+        bench_repack();
+    }
+    else if (!strcmp(name, "scale"))
+    {
+        bench_scale();
+    }
+    else if (!strcmp(name, "samples"))
+    {
+        bench_samples();
+    }
+    else
+    {
+        fprintf(stderr, "Unknown benchmark %s (available: queue, repack, scale, samples)\n", name);
+        return 1;
+    }
 
-    printf("FPS %d\n", videoFPS);
-    printf("duration %d\n", video_duration);
-    // end of islem patch fix video quit
+    return 0;
+}
+#endif /* __BENCHMARK__ */
+
+/* (re)create the window; queue_picture notices the new size and
+   reallocates the overlays to match */
+#ifdef USE_SDL2
+/* The first call opens the window, the size of the desktop for 0 x 0
+   like SDL_SetVideoMode, and its renderer; later calls only pick up
+   its new size. Without a hardware renderer, e.g. on the dummy video
+   driver, the software one is used. */
+static int set_video_mode(int w, int h)
+{
+    SDL_DisplayMode mode;
+    SDL_RendererInfo info;
 
-    for (;;)
+    if (!window)
     {
-        if (packet_queue_get(&is->videoq, packet, 1) < 0)
+        if ((!w || !h) && SDL_GetDesktopDisplayMode(0, &mode) == 0)
         {
-            // means we quit getting packets
-            break;
+            w = mode.w;
+            h = mode.h;
         }
 
-        pts = 0;
-
-        // Save global pts to be stored in pFrame in first call
-        global_video_pkt_pts = packet->pts;
-        // Decode video frame
-        avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished,
-                              packet);
+        window = SDL_CreateWindow("videoplayer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                  w ? w : 640, h ? h : 480, SDL_WINDOW_RESIZABLE);
 
-        if (packet->dts == AV_NOPTS_VALUE && pFrame->opaque && *(uint64_t *)pFrame->opaque != AV_NOPTS_VALUE)
-        {
-            pts = *(uint64_t *)pFrame->opaque;
-        }
-        else if (packet->dts != AV_NOPTS_VALUE)
-        {
-            pts = packet->dts;
-        }
-        else
+        if (!window)
         {
-            pts = 0;
+            fprintf(stderr, "SDL_CreateWindow: %s\n", SDL_GetError());
+            return -1;
         }
 
-        pts *= av_q2d(is->video_st->time_base);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED |
+                                                      (use_vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 
-        // Did we get a video frame?
-        if (frameFinished)
+        if (!renderer)
         {
-            pts = synchronize_video(is, pFrame, pts);
-            if (queue_picture(is, pFrame, pts) < 0)
-            {
-                break;
-            }
+            fprintf(stderr, "SDL_CreateRenderer: %s, using the software renderer\n", SDL_GetError());
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
         }
 
-        av_free_packet(packet);
-
-        // Start of Islem Patch to fix video quit
-        packet_step = packet->dts - temp_packet;
-        temp_packet = packet->dts;
-
-        if (packet_step < 0)
-            packet_step = -1 * packet_step;
-        else if (packet_step == 0)
-            packet_step = 400;
+        if (!renderer)
+        {
+            fprintf(stderr, "SDL_CreateRenderer: %s\n", SDL_GetError());
+            return -1;
+        }
 
-        printf("this is step %d\n", packet_step);
-        printf("the frame is at %d\n", (packet->dts / packet_step) / videoFPS);
-        if ((((packet->dts / packet_step) / videoFPS)) == video_duration)
+        if (use_vsync && SDL_GetRendererInfo(renderer, &info) == 0 &&
+            !(info.flags & SDL_RENDERER_PRESENTVSYNC))
         {
-            printf("Video Finished\n");
-            SDL_Delay(100);
-            is->quit = 1;
+            fprintf(stderr, "-vsync: the %s renderer cannot wait for the refresh\n", info.name);
         }
-        // End of Islem Patch
     }
 
-    av_free(pFrame);
-
+    SDL_LockMutex(screen_mutex);
+    SDL_GetRendererOutputSize(renderer, &screen_w, &screen_h);
+    SDL_UnlockMutex(screen_mutex);
     return 0;
 }
-
-int stream_component_open(VideoState *is, int stream_index)
+#else
+static int set_video_mode(int w, int h)
 {
+    SDL_LockMutex(screen_mutex);
+#ifndef __DARWIN__
+    screen = SDL_SetVideoMode(w, h, 0, SDL_RESIZABLE);
+#else
+    screen = SDL_SetVideoMode(w, h, 24, SDL_RESIZABLE);
+#endif
+    SDL_UnlockMutex(screen_mutex);
 
-    AVFormatContext *pFormatCtx = is->pFormatCtx;
-    AVCodecContext *codecCtx = NULL;
-    AVCodec *codec = NULL;
-    AVDictionary *optionsDict = NULL;
-    SDL_AudioSpec wanted_spec, spec;
-
-    if (stream_index < 0 || stream_index >= pFormatCtx->nb_streams)
-    {
-        return -1;
-    }
+    return screen ? 0 : -1;
+}
+#endif
 
-    // Get a pointer to the codec context for the video stream
-    codecCtx = pFormatCtx->streams[stream_index]->codec;
+/* SDL_WaitEvent, but pumping events under screen_mutex. With SDL2 the
+   main thread is the only one drawing, so there is nothing to lock. */
+static int wait_event(SDL_Event *event)
+{
+#ifdef USE_SDL2
+    return SDL_WaitEvent(event);
+#else
+    int n;
 
-    if (codecCtx->codec_type == AVMEDIA_TYPE_AUDIO)
+    for (;;)
     {
-        // Set audio settings from codec info
-        wanted_spec.freq = codecCtx->sample_rate;
-        wanted_spec.format = AUDIO_S16SYS;
-        wanted_spec.channels = codecCtx->channels;
-        wanted_spec.silence = 0;
-        wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
-        wanted_spec.callback = audio_callback;
-        wanted_spec.userdata = is;
+        SDL_LockMutex(screen_mutex);
+        SDL_PumpEvents();
+        n = SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_ALLEVENTS);
+        SDL_UnlockMutex(screen_mutex);
 
-        if (SDL_OpenAudio(&wanted_spec, &spec) < 0)
+        if (n != 0)
         {
-            fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
-            return -1;
+            return n > 0;
         }
 
-        is->audio_hw_buf_size = spec.size;
+        SDL_Delay(10);
     }
+#endif
+}
 
-    codec = avcodec_find_decoder(codecCtx->codec_id);
+static void playlist_add(const char *filename)
+{
+    av_dynarray_add(&playlist, &nb_playlist, av_strdup(filename));
+}
 
-    if (!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0))
+/* -playlist FILE: one input per line, blank lines and lines starting
+   with # are skipped */
+static int playlist_load(const char *path)
+{
+    char line[1024];
+    FILE *f = fopen(path, "r");
+
+    if (!f)
     {
-        fprintf(stderr, "Unsupported codec!\n");
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
         return -1;
     }
 
-    switch (codecCtx->codec_type)
+    while (fgets(line, sizeof(line), f))
     {
-    case AVMEDIA_TYPE_AUDIO:
-        is->audioStream = stream_index;
-        is->audio_st = pFormatCtx->streams[stream_index];
-        is->audio_buf_size = 0;
-        is->audio_buf_index = 0;
-
-        /* averaging filter for audio sync */
-        is->audio_diff_avg_coef = exp(log(0.01 / AUDIO_DIFF_AVG_NB));
-        is->audio_diff_avg_count = 0;
-        /* Correct audio only if larger error than this */
-        is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / codecCtx->sample_rate;
-
-        memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-        packet_queue_init(&is->audioq);
-        SDL_PauseAudio(0);
-        break;
-
-    case AVMEDIA_TYPE_VIDEO:
-        is->videoStream = stream_index;
-        is->video_st = pFormatCtx->streams[stream_index];
-
-        is->frame_timer = (double)av_gettime() / 1000000.0;
-        is->frame_last_delay = 40e-3;
-        is->video_current_pts_time = av_gettime();
-
-        packet_queue_init(&is->videoq);
-        is->video_tid = SDL_CreateThread(video_thread, is);
-        is->sws_ctx =
-            sws_getContext(
-                is->video_st->codec->width,
-                is->video_st->codec->height,
-                is->video_st->codec->pix_fmt,
-                is->video_st->codec->width,
-                is->video_st->codec->height,
-                AV_PIX_FMT_YUV420P,
-                SWS_BILINEAR,
-                NULL,
-                NULL,
-                NULL);
-        codecCtx->get_buffer2 = our_get_buffer;
-        break;
+        line[strcspn(line, "\r\n")] = 0;
 
-    default:
-        break;
+        if (line[0] && line[0] != '#')
+        {
+            playlist_add(line);
+        }
     }
 
+    fclose(f);
     return 0;
 }
 
-int decode_interrupt_cb(void *opaque)
-{
-    return (global_video_state && global_video_state->quit);
-}
-
-int decode_thread(void *arg)
+/* Start the first item from *item on that gets as far as a demuxer
+   thread, and point *item past it. NULL at the end of the playlist. */
+static VideoState *playlist_start(int *item)
 {
+    VideoState *is = NULL;
 
-    VideoState *is = (VideoState *)arg;
-    AVFormatContext *pFormatCtx = NULL;
-    AVPacket pkt1, *packet = &pkt1;
-
-    AVDictionary *io_dict = NULL;
-    AVIOInterruptCB callback;
-
-    int video_index = -1;
-    int audio_index = -1;
-    int i;
-
-    is->videoStream = -1;
-    is->audioStream = -1;
-    is->audio_need_resample = 0;
-
-    global_video_state = is;
-    // will interrupt blocking functions if we quit!
-    callback.callback = decode_interrupt_cb;
-    callback.opaque = is;
-
-    if (avio_open2(&is->io_context, is->filename, 0, &callback, &io_dict))
-    {
-        fprintf(stderr, "Unable to open I/O for %s\n", is->filename);
-        return -1;
-    }
-
-    // Open video file
-    if (avformat_open_input(&pFormatCtx, is->filename, NULL, NULL) != 0)
+    while (!is && *item < nb_playlist)
     {
-        return -1; // Couldn't open file
+        is = stream_start(playlist[(*item)++], -1);
     }
 
-    is->pFormatCtx = pFormatCtx;
+    return is;
+}
 
-    //printf("the duration is %ld\n", is->pFormatCtx->duration/AV_TIME_BASE);
+/* "512k", "8m" or plain bytes */
+static int parse_size(const char *arg)
+{
+    char *end;
+    long v = strtol(arg, &end, 10);
 
-    // Retrieve stream information
-    if (avformat_find_stream_info(pFormatCtx, NULL) < 0)
+    if (*end == 'k' || *end == 'K')
     {
-        return -1; // Couldn't find stream information
+        v <<= 10;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        v <<= 20;
     }
 
-    // Dump information about file onto standard error
-    av_dump_format(pFormatCtx, 0, is->filename, 0);
+    return v > 0 && v <= INT_MAX / 2 ? (int)v : 0;
+}
 
-    // Find the first video stream
+/* left/right seek 10 s, down/up 60 s, 0-9 jump to 0%-90% of the file */
+static void handle_seek_key(VideoState *is, SDLKey key)
+{
+    AVFormatContext *ic = is->pFormatCtx;
+    double incr, pos;
 
-    for (i = 0; i < pFormatCtx->nb_streams; i++)
+    switch (key)
     {
-        if (pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO &&
-            video_index < 0)
+    case SDLK_LEFT:
+        incr = -10.0;
+        break;
+    case SDLK_RIGHT:
+        incr = 10.0;
+        break;
+    case SDLK_DOWN:
+        incr = -60.0;
+        break;
+    case SDLK_UP:
+        incr = 60.0;
+        break;
+    default:
+        if (key >= SDLK_0 && key <= SDLK_9 && ic->duration != AV_NOPTS_VALUE)
         {
-            video_index = i;
+            stream_seek(is, (ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0) +
+                                ic->duration / 10 * (key - SDLK_0));
         }
+        return;
+    }
 
-        if (pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO &&
-            audio_index < 0)
+    /* the master clock is the video clock, which an audio-only file
+       never sets: go by the samples played instead */
+    pos = is->video_st ? get_master_clock(is) : get_audio_clock(is);
+    stream_seek(is, (int64_t)((pos + incr) * AV_TIME_BASE));
+}
+
+/* Was event sent by is? Events of a closed item can still be queued,
+   and a later item can be allocated at its address, so the pointer
+   alone does not tell. */
+static int event_from(SDL_Event *event, VideoState *is)
+{
+    return is && event->user.data1 == is && event->user.code == is->generation;
+}
+
+/* the -mosaic tile p is, or -1 for anything else */
+static int mosaic_tile(void *p)
+{
+    int i;
+
+    for (i = 0; i < nb_mosaic; i++)
+    {
+        if (mosaic[i] && mosaic[i] == p)
         {
-            audio_index = i;
+            return i;
         }
     }
 
-    if (audio_index >= 0)
-    {
-        stream_component_open(is, audio_index);
-    }
+    return -1;
+}
 
-    if (video_index >= 0)
-    {
-        stream_component_open(is, video_index);
-    }
+/* -mosaic: every input plays at once in its own cell of the window,
+   until all of them have played out */
+static int run_mosaic(void)
+{
+    SDL_Event event;
+    int finished[MOSAIC_MAX] = {0};
+    int64_t start = av_gettime_relative();
+    int i, done = 0;
 
-    if (is->videoStream < 0 && is->audioStream < 0)
+    nb_mosaic = nb_playlist;
+    mosaic_cols = (int)ceil(sqrt(nb_mosaic));
+    mosaic_rows = (nb_mosaic + mosaic_cols - 1) / mosaic_cols;
+
+    if (!headless)
     {
-        fprintf(stderr, "%s: could not open codecs\n", is->filename);
-        goto fail;
+        if (set_video_mode(0, 0) < 0)
+        {
+            fprintf(stderr, "SDL: could not set video mode - exiting\n");
+            return 1;
+        }
     }
 
-    if (audio_index >= 0 && pFormatCtx->streams[audio_index]->codec->sample_fmt != AV_SAMPLE_FMT_S16)
+    for (i = 0; i < nb_mosaic; i++)
     {
-        is->audio_need_resample = 1;
-        is->pResampledOut = NULL;
-        is->pSwrCtx = NULL;
+        VideoState *is = stream_start(playlist[i], i);
 
-        printf("Configure resampler: ");
+        /* the callback mixes whatever is in mosaic[] */
+        SDL_LockAudio();
+        mosaic[i] = is;
+        SDL_UnlockAudio();
 
-        printf("libSwResample\n");
-        is->pSwrCtx = swr_alloc();
-
-        // Some MP3/WAV don't tell this so make assumtion that
-        // They are stereo not 5.1
-        if (pFormatCtx->streams[audio_index]->codec->channel_layout == 0 && pFormatCtx->streams[audio_index]->codec->channels == 2)
+        if (!is)
         {
-            pFormatCtx->streams[audio_index]->codec->channel_layout = AV_CH_LAYOUT_STEREO;
+            finished[i] = 1;
+            done++;
         }
-        else if (pFormatCtx->streams[audio_index]->codec->channel_layout == 0 && pFormatCtx->streams[audio_index]->codec->channels == 1)
+        else if (!headless)
         {
-            pFormatCtx->streams[audio_index]->codec->channel_layout = AV_CH_LAYOUT_MONO;
+            stream_activate(is);
         }
-        else if (pFormatCtx->streams[audio_index]->codec->channel_layout == 0 && pFormatCtx->streams[audio_index]->codec->channels == 0)
+        else if (stats_path && stats_interval > 0)
         {
-            pFormatCtx->streams[audio_index]->codec->channel_layout = AV_CH_LAYOUT_STEREO;
-            pFormatCtx->streams[audio_index]->codec->channels = 2;
+            is->stats_tid = create_thread(stats_thread, is);
         }
+    }
 
-        av_opt_set_int(is->pSwrCtx, "in_channel_layout",
-                       pFormatCtx->streams[audio_index]->codec->channel_layout, 0);
-        av_opt_set_int(is->pSwrCtx, "in_sample_fmt",
-                       pFormatCtx->streams[audio_index]->codec->sample_fmt, 0);
-        av_opt_set_int(is->pSwrCtx, "in_sample_rate",
-                       pFormatCtx->streams[audio_index]->codec->sample_rate, 0);
-
-        av_opt_set_int(is->pSwrCtx, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-        av_opt_set_int(is->pSwrCtx, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-        av_opt_set_int(is->pSwrCtx, "out_sample_rate", 44100, 0);
-
-        if (swr_init(is->pSwrCtx) < 0)
+    if (headless)
+    {
+        for (i = 0; i < nb_mosaic; i++)
         {
+            if (mosaic[i])
+            {
+                stream_join(mosaic[i]);
+            }
+        }
 
-            fprintf(stderr, " ERROR!! From Samplert: %d Hz Sample format: %s\n",
-                    pFormatCtx->streams[audio_index]->codec->sample_rate,
-                    av_get_sample_fmt_name(pFormatCtx->streams[audio_index]->codec->sample_fmt));
-            fprintf(stderr, "         To 44100 Sample format: s16\n");
-            is->audio_need_resample = 0;
-            is->pSwrCtx = NULL;
-            ;
+        for (i = 0; i < nb_mosaic; i++)
+        {
+            if (mosaic[i])
+            {
+                printf("%s:\n", mosaic[i]->filename);
+                headless_report(mosaic[i], av_gettime_relative() - start);
+                print_stats(mosaic[i]);
+            }
         }
-    }
 
-    // main decode loop
+        SDL_Quit();
+        return 0;
+    }
 
-    for (;;)
+    while (done < nb_mosaic && wait_event(&event))
     {
-        if (is->quit)
+        if (event.type == SDL_QUIT)
         {
-
             break;
         }
 
-        // seek stuff goes here
-        if (is->audioq.size > MAX_AUDIOQ_SIZE ||
-            is->videoq.size > MAX_VIDEOQ_SIZE)
+        switch (event.type)
         {
-            SDL_Delay(10);
-            continue;
-        }
+        case FF_QUIT_EVENT:
+            /* played out or failed to open: its last picture stays */
+            i = mosaic_tile(event.user.data1);
 
-        if (av_read_frame(is->pFormatCtx, packet) < 0)
-        {
-            if (is->pFormatCtx->pb->error == 0)
+            if (i >= 0 && !finished[i])
             {
-                SDL_Delay(100); /* no error; wait for user input */
-                continue;
+                finished[i] = 1;
+                done++;
             }
-            else
+            break;
+
+        case FF_ALLOC_EVENT:
+            if (mosaic_tile(event.user.data1) >= 0)
             {
-                break;
+                alloc_picture(event.user.data1);
             }
-        }
+            break;
 
-        // Is this a packet from the video stream?
-        if (packet->stream_index == is->videoStream)
-        {
-            packet_queue_put(&is->videoq, packet);
-        }
-        else if (packet->stream_index == is->audioStream)
-        {
-            packet_queue_put(&is->audioq, packet);
+#ifdef USE_SDL2
+        case FF_DISPLAY_EVENT:
+            if (mosaic_tile(event.user.data1) >= 0)
+            {
+                display_event(event.user.data1);
+            }
+            break;
+#endif
+
+        case SDL_KEYDOWN:
+            /* seek the whole wall together */
+            for (i = 0; i < nb_mosaic; i++)
+            {
+                if (!finished[i] && mosaic[i]->pFormatCtx &&
+                    (mosaic[i]->video_st || mosaic[i]->audio_st))
+                {
+                    handle_seek_key(mosaic[i], event.key.keysym.sym);
+                }
+            }
+            break;
+
+#ifdef USE_SDL2
+        case SDL_WINDOWEVENT:
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+            {
+                set_video_mode(event.window.data1, event.window.data2);
+            }
+
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED ||
+                event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                screen_dirty = 1;
+            }
+            break;
+#else
+        case SDL_VIDEORESIZE:
+            if (set_video_mode(event.resize.w, event.resize.h) < 0)
+            {
+                fprintf(stderr, "SDL: could not set video mode - exiting\n");
+                exit(1);
+            }
+            break;
+#endif
+
+        default:
+            break;
         }
-        else
+
+#ifdef USE_SDL2
+        screen_present(mosaic, nb_mosaic);
+#endif
+    }
+
+    for (i = 0; i < nb_mosaic; i++)
+    {
+        if (mosaic[i])
         {
-            av_free_packet(packet);
+            stream_abort(mosaic[i]);
         }
     }
 
-    /* all done - wait for it */
-    while (!is->quit)
+    /* don't pull the display out from under a picture being shown */
+    for (i = 0; i < nb_mosaic; i++)
     {
-        SDL_Delay(100);
+        if (mosaic[i])
+        {
+            SDL_WaitThread(mosaic[i]->present_tid, NULL);
+            print_stats(mosaic[i]);
+        }
     }
 
-fail:
-{
-    SDL_Event event;
-    event.type = FF_QUIT_EVENT;
-    event.user.data1 = is;
-    SDL_PushEvent(&event);
-}
+    SDL_Quit();
     return 0;
 }
 
@@ -1277,94 +5669,301 @@ int main(int argc, char *argv[])
 
     SDL_Event event;
 
-    VideoState *is;
+    VideoState *is, *next = NULL, *prev;
+    int64_t start;
+    int i, item = 0;
+
+#ifdef __BENCHMARK__
+    if (argc >= 3 && !strcmp(argv[1], "-bench"))
+    {
+        return run_benchmark(argv[2]);
+    }
+#endif
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-pictq") && i + 1 < argc)
+        {
+            pictq_depth = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+        {
+            decoder_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-scale-threads") && i + 1 < argc)
+        {
+            scale_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-headless"))
+        {
+            headless = 1;
+        }
+        else if (!strcmp(argv[i], "-mmap"))
+        {
+            use_mmap = 1;
+        }
+        else if (!strcmp(argv[i], "-readahead") && i + 1 < argc)
+        {
+            readahead_size = parse_size(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-slow-io") && i + 1 < argc)
+        {
+            slow_io_ms = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-fast"))
+        {
+            fast_start = 1;
+        }
+        else if (!strcmp(argv[i], "-probe-cache") && i + 1 < argc)
+        {
+            probe_cache_dir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-stats") && i + 1 < argc)
+        {
+            stats_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-stats-interval") && i + 1 < argc)
+        {
+            stats_interval = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-vsync"))
+        {
+            use_vsync = 1;
+        }
+        else if (!strcmp(argv[i], "-mosaic"))
+        {
+            mosaic_enabled = 1;
+        }
+        else if (!strcmp(argv[i], "-audio") && i + 1 < argc)
+        {
+            i++;
+            audio_tile = !strcmp(argv[i], "mix") ? -1 : atoi(argv[i]);
+        }
+        else if (!strcmp(argv[i], "-playlist") && i + 1 < argc)
+        {
+            if (playlist_load(argv[++i]) < 0)
+            {
+                exit(1);
+            }
+        }
+        else
+        {
+            playlist_add(argv[i]);
+        }
+    }
+
+    if (!nb_playlist)
+    {
+        fprintf(stderr, "Usage: test [-pictq depth] [-threads n] [-scale-threads n] [-headless] [-mmap] [-readahead size[k|m]] [-slow-io ms] [-fast] [-probe-cache dir] [-stats file.json [-stats-interval ms]] [-playlist list.txt] [-mosaic [-audio n|mix]] [-vsync] <file> [file ...]\n");
+        exit(1);
+    }
+
+    if (pictq_depth < 1 || pictq_depth > VIDEO_PICTURE_QUEUE_SIZE_MAX)
+    {
+        fprintf(stderr, "-pictq must be between 1 and %d\n", VIDEO_PICTURE_QUEUE_SIZE_MAX);
+        exit(1);
+    }
 
-    is = av_mallocz(sizeof(VideoState));
+#ifndef USE_SDL2
+    if (use_vsync)
+    {
+        fprintf(stderr, "-vsync needs the SDL2 build, ignored\n");
+    }
+#endif
 
-    if (argc < 2)
+    if (mosaic_enabled && nb_playlist > MOSAIC_MAX)
     {
-        fprintf(stderr, "Usage: test <file>\n");
+        fprintf(stderr, "-mosaic shows at most %d inputs\n", MOSAIC_MAX);
         exit(1);
     }
 
     // Register all formats and codecs
     av_register_all();
+    repack_init();
+    sample_convert_init();
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER))
+    if (SDL_Init(headless ? SDL_INIT_TIMER : SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER))
     {
         fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
         exit(1);
     }
 
-    // Make a screen to put our video
-#ifndef __DARWIN__
-    screen = SDL_SetVideoMode(0, 0, 0, 0);
-#else
-    screen = SDL_SetVideoMode(0, 0, 24, 0);
-#endif
+    screen_mutex = SDL_CreateMutex();
+    audio_device_mutex = SDL_CreateMutex();
+
+    av_init_packet(&flush_pkt);
+    flush_pkt.data = (uint8_t *)&flush_pkt;
+    flush_pkt.size = 0;
 
-    if (!screen)
+    if (mosaic_enabled)
     {
-        fprintf(stderr, "SDL: could not set video mode - exiting\n");
-        exit(1);
+        return run_mosaic();
     }
 
-    av_strlcpy(is->filename, argv[1], 1024);
+    if (headless)
+    {
+        /* no window, overlay or refresh timer: run the decoders flat out
+           and report how fast they went, one item after the other */
+        while ((is = playlist_start(&item)))
+        {
+            start = av_gettime_relative();
 
-    is->pictq_mutex = SDL_CreateMutex();
-    is->pictq_cond = SDL_CreateCond();
+            if (stats_path && stats_interval > 0)
+            {
+                is->stats_tid = create_thread(stats_thread, is);
+            }
 
-    schedule_refresh(is, 40);
+            stream_join(is);
+            headless_report(is, av_gettime_relative() - start);
+            print_stats(is);
+            stream_close(is);
+        }
 
-    is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
-    is->parse_tid = SDL_CreateThread(decode_thread, is);
+        SDL_Quit();
+        return 0;
+    }
 
-    if (!is->parse_tid)
+    // Make a screen to put our video
+    if (set_video_mode(0, 0) < 0)
     {
-        av_free(is);
-        return -1;
+        fprintf(stderr, "SDL: could not set video mode - exiting\n");
+        exit(1);
+    }
+
+    if (!(is = playlist_start(&item)))
+    {
+        exit(1);
     }
 
+    stream_activate(is);
+
     //printf("hey there %ld\n", is->pFormatCtx->streams[is->videoStream]->nb_frames);
 
-    while (SDL_WaitEvent(&event))
+    while (wait_event(&event))
     {
-        if (is->quit)
-        {
-            event.type = SDL_QUIT;
-        }
         switch (event.type)
         {
 
+        case FF_FIRST_FRAME_EVENT:
+            /* open the next item now, so it has its first pictures and
+               samples decoded by the time this one ends */
+            if (event_from(&event, is) && !next)
+            {
+                next = playlist_start(&item);
+            }
+            break;
+
         case FF_QUIT_EVENT:
+            if (event_from(&event, next))
+            {
+                /* the next item would not open: try the one after */
+                stream_close(next);
+                next = playlist_start(&item);
+                break;
+            }
+
+            if (!event_from(&event, is))
+            {
+                break;
+            }
+
+            /* is has played out, or could not be opened */
+            if (is->pFormatCtx)
+            {
+                print_stats(is);
+            }
+
+            if (!next && !(next = playlist_start(&item)))
+            {
+                SDL_Quit();
+                exit(0);
+            }
+
+            /* next takes over before is is torn down, so the picture and
+               the sound do not wait for is's threads to end. The last
+               picture stays on screen until next shows its first */
+            prev = is;
+            is = next;
+            next = NULL;
+            stream_activate(is);
+            stream_close(prev);
+
+            if (atomic_load(&is->first_frame_time))
+            {
+                /* its audio started while the previous item was current */
+                next = playlist_start(&item);
+            }
+            break;
+
         case SDL_QUIT:
         {
-            is->quit = 1;
-            /*
-                 * If the video has finished playing, then both the picture and
-                 * audio queues are waiting for more data.  Make them stop
-                 * waiting and terminate normally.
-                 */
-            SDL_CondSignal(is->audioq.cond);
-            SDL_CondSignal(is->videoq.cond);
+            if (next)
+            {
+                stream_abort(next);
+            }
+
+            /* don't pull the display out from under a picture being shown */
+            stream_abort(is);
+            SDL_WaitThread(is->present_tid, NULL);
+
+            print_stats(is);
             SDL_Quit();
             exit(0);
         }
         break;
 
+        case SDL_KEYDOWN:
+            if (is->pFormatCtx && (is->video_st || is->audio_st))
+            {
+                handle_seek_key(is, event.key.keysym.sym);
+            }
+            break;
+
         case FF_ALLOC_EVENT:
-            alloc_picture(event.user.data1);
+            /* only for items still open */
+            if (event_from(&event, is) || event_from(&event, next))
+            {
+                alloc_picture(event.user.data1);
+            }
             break;
 
-        case FF_REFRESH_EVENT:
-        {
-            video_refresh_timer(event.user.data1);
+#ifdef USE_SDL2
+        case FF_DISPLAY_EVENT:
+            if (event_from(&event, is))
+            {
+                display_event(is);
+            }
+            break;
+
+        case SDL_WINDOWEVENT:
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+            {
+                set_video_mode(event.window.data1, event.window.data2);
+            }
 
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED ||
+                event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                screen_dirty = 1;
+            }
             break;
-        }
+#else
+        case SDL_VIDEORESIZE:
+            if (set_video_mode(event.resize.w, event.resize.h) < 0)
+            {
+                fprintf(stderr, "SDL: could not set video mode - exiting\n");
+                exit(1);
+            }
+            break;
+#endif
+
         default:
             break;
         }
+
+#ifdef USE_SDL2
+        screen_present(&is, 1);
+#endif
     }
 
     return 0;